@@ -0,0 +1,188 @@
+/* Running many builds on one shared search pool.
+ *
+ * Each build runs on a runner thread of its own, which spends nearly all
+ * its time waiting for the pool. Runners take the next job from the list
+ * as they finish one, so there are always up to concurrency collision
+ * searches ready, and the pool's workers move to whichever of them has
+ * the fewest workers as soon as they're free.
+ */
+#define _GNU_SOURCE
+#include "batch.h"
+#include "pool.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_RUNNERS 1024
+
+static int from_hex(const char *s, unsigned char *out, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		unsigned int b;
+		if(sscanf(s + 2*i, "%2x", &b) != 1)
+			return -1;
+		out[i] = b;
+	}
+	return s[2*n] == '\0' ? 0 : -1;
+}
+
+int CollParseIV(const char *hex, uint32_t iv[4]) {
+	unsigned char bytes[16];
+	if(from_hex(hex, bytes, 16) < 0)
+		return -1;
+	for(int i = 0; i < 4; i++)
+		iv[i] = bytes[4*i] | bytes[4*i+1] << 8 | bytes[4*i+2] << 16 | (uint32_t)bytes[4*i+3] << 24;
+	return 0;
+}
+
+int CollParseBadchars(const char *hex, char badchars[256]) {
+	size_t n = strlen(hex);
+	unsigned char bytes[256];
+	if(n % 2 || n / 2 > sizeof(bytes) || from_hex(hex, bytes, n / 2) < 0)
+		return -1;
+	memset(badchars, 0, 256);
+	for(size_t i = 0; i < n / 2; i++)
+		badchars[bytes[i]] = 1;
+	return 0;
+}
+
+int CollBuildOption(const char *word, struct CollBuildOptions *opts, char badchars[256]) {
+	const char *value = strchr(word, '=');
+	char *end;
+
+	if(!value)
+		return -1;
+	value++;
+	if(strncmp(word, "priority=", 9) == 0) {
+		opts->priority = atoi(value);
+	} else if(strncmp(word, "badchars=", 9) == 0) {
+		if(CollParseBadchars(value, badchars) < 0)
+			return -1;
+		opts->badchars = badchars;
+	} else if(strncmp(word, "iv=", 3) == 0) {
+		if(CollParseIV(value, opts->iv) < 0)
+			return -1;
+	} else if(strncmp(word, "prefix=", 7) == 0) {
+		opts->prefix = value;
+	} else if(strncmp(word, "position=", 9) == 0) {
+		opts->position = strtoull(value, &end, 10);
+		if(*end)
+			return -1;
+	} else if(strncmp(word, "manifest=", 9) == 0) {
+		opts->manifest = value;
+	} else if(strncmp(word, "cache=", 6) == 0) {
+		opts->cache = atoi(value);
+	} else if(strncmp(word, "verify=", 7) == 0) {
+		opts->verify = atoi(value);
+	} else if(strncmp(word, "hedge=", 6) == 0) {
+		opts->hedge = atoi(value);
+	} else if(strncmp(word, "hedge_delay=", 12) == 0) {
+		opts->hedge_delay_ms = atoi(value);
+	} else if(strncmp(word, "slim=", 5) == 0) {
+		opts->slim = atoi(value);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+int CollBatchParse(const char *line, struct CollBatchJob *job) {
+	char **words = NULL;
+	int nwords = 0;
+
+	memset(job, 0, sizeof(*job));
+	CollBuildDefaults(&job->opts);
+	if((job->line = strdup(line)) == NULL)
+		goto fail;
+	for(char *save, *w = strtok_r(job->line, " \t\r\n", &save); w; w = strtok_r(NULL, " \t\r\n", &save)) {
+		if(strchr(w, '=')) {
+			if(CollBuildOption(w, &job->opts, job->badchars) < 0)
+				goto fail;
+			continue;
+		}
+		char **more = realloc(words, sizeof(*words) * (nwords + 1));
+		if(!more)
+			goto fail;
+		words = more;
+		words[nwords++] = w;
+	}
+	if(nwords < 3)
+		goto fail;
+
+	job->outdir = words[0];
+	job->nimages = nwords - 1;
+	if((job->images = calloc(job->nimages, sizeof(*job->images))) == NULL)
+		goto fail;
+	for(int i = 0; i < job->nimages; i++)
+		job->images[i].path = words[i + 1];
+	free(words);
+	return 0;
+
+fail:
+	free(words);
+	CollBatchJobFree(job);
+	return -1;
+}
+
+void CollBatchJobFree(struct CollBatchJob *job) {
+	free(job->images);
+	free(job->line);
+	memset(job, 0, sizeof(*job));
+}
+
+struct batch {
+	struct CollPool *pool;
+	struct CollBatchJob *jobs;
+	int njobs;
+	int next;
+	int failed;
+	pthread_mutex_t lock;
+	void (*done)(void *arg, int index, int rc, const char *error);
+	void *arg;
+};
+
+static void *runner_thread(void *arg) {
+	struct batch *b = arg;
+	for(;;) {
+		int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+		if(i >= b->njobs)
+			return NULL;
+		struct CollBatchJob *job = &b->jobs[i];
+		job->opts.pool = b->pool;
+		// the job may have been copied since it was parsed
+		if(job->opts.badchars)
+			job->opts.badchars = job->badchars;
+		int rc = CollBuild(&job->opts, job->images, job->nimages, job->outdir);
+
+		pthread_mutex_lock(&b->lock);
+		if(rc < 0)
+			b->failed++;
+		if(b->done)
+			b->done(b->arg, i, rc, rc < 0 ? CollBuildError() : NULL);
+		pthread_mutex_unlock(&b->lock);
+	}
+}
+
+int CollBatchRun(struct CollPool *pool, struct CollBatchJob *jobs, int njobs, int concurrency,
+                 void (*done)(void *arg, int index, int rc, const char *error), void *arg) {
+	struct batch b = { pool, jobs, njobs, 0, 0, PTHREAD_MUTEX_INITIALIZER, done, arg };
+	pthread_t threads[MAX_RUNNERS];
+	int started = 0;
+
+	if(concurrency <= 0)
+		concurrency = CollPoolThreads(pool);
+	if(concurrency > njobs)
+		concurrency = njobs;
+	if(concurrency > MAX_RUNNERS)
+		concurrency = MAX_RUNNERS;
+	for(int i = 1; i < concurrency; i++) {
+		if(pthread_create(&threads[started], NULL, runner_thread, &b) == 0)
+			started++;
+	}
+	// the calling thread runs builds too
+	runner_thread(&b);
+	for(int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&b.lock);
+	return b.failed;
+}
@@ -0,0 +1,48 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "jpegcoll.h"
+
+/* Many independent builds at once on one search pool (batch.c). Within a
+ * build the collisions are a chain, each searched from the output so far,
+ * but builds don't depend on each other: with enough of them in flight
+ * there's always a ready search for an idle worker to join, whichever
+ * build it belongs to, and the pool spreads its threads over them.
+ *
+ * A job is written as for colld's build request and collbatch's job file:
+ *
+ *   OUTDIR IMAGE1 IMAGE2 .. [iv=IV] [prefix=PATH] [position=N]
+ *          [manifest=PATH] [verify=1] [priority=N] [badchars=HEX]
+ *          [hedge=K] [hedge_delay=MS] [slim=LEVEL] [cache=0]
+ */
+
+struct CollBatchJob {
+	char *outdir;
+	struct CollImage *images;
+	int nimages;
+	struct CollBuildOptions opts;
+	char badchars[256];
+	char *line;	/* what the strings above point into */
+};
+
+/* One KEY=VALUE option into opts; badchars is where a badchars table goes.
+ * Returns 0, or -1 if it isn't one. */
+extern int CollBuildOption(const char *word, struct CollBuildOptions *opts, char badchars[256]);
+/* An IV as 32 hex digits in the byte order of a digest. 0 on success. */
+extern int CollParseIV(const char *hex, uint32_t iv[4]);
+/* Byte values, two hex digits each, into a 256-entry badchars table (see
+ * MD5CollideBlock0). 0 on success. */
+extern int CollParseBadchars(const char *hex, char badchars[256]);
+/* Parse a job line, starting from CollBuildDefaults. Returns 0, or -1 if
+ * it isn't a valid job (or memory ran out). */
+extern int CollBatchParse(const char *line, struct CollBatchJob *job);
+extern void CollBatchJobFree(struct CollBatchJob *job);
+
+/* Run the jobs on pool, up to concurrency builds at a time (0 = one per
+ * pool thread). done is called, one call at a time, as each job finishes,
+ * with its index, CollBuild's result and the error if it failed. Returns
+ * the number of jobs that failed. */
+extern int CollBatchRun(struct CollPool *pool, struct CollBatchJob *jobs, int njobs, int concurrency,
+                        void (*done)(void *arg, int index, int rc, const char *error), void *arg);
+
+#endif /* !BATCH_H */
@@ -0,0 +1,130 @@
+/* On-disk result cache, see cache.h */
+#include "cache.h"
+#include "md5.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int cache_dir(const char *bucket, char *path, size_t size) {
+	const char *env;
+	int n;
+
+	if((env = getenv("COLL_JPEG_CACHE_DIR")) && *env)
+		n = snprintf(path, size, "%s/%s", env, bucket);
+	else if((env = getenv("XDG_CACHE_HOME")) && *env)
+		n = snprintf(path, size, "%s/coll-jpeg/%s", env, bucket);
+	else if((env = getenv("HOME")) && *env)
+		n = snprintf(path, size, "%s/.cache/coll-jpeg/%s", env, bucket);
+	else
+		return -1;
+	return (n < 0 || (size_t)n >= size) ? -1 : n;
+}
+
+// mkdir -p, modifies path in place but restores it
+static int make_dirs(char *path) {
+	for(char *p = path + 1; ; p++) {
+		if(*p != '/' && *p != '\0')
+			continue;
+		char c = *p;
+		*p = '\0';
+		int r = mkdir(path, 0777);
+		*p = c;
+		if(r < 0 && errno != EEXIST)
+			return -1;
+		if(c == '\0')
+			return 0;
+	}
+}
+
+static int entry_path(const char *bucket, const void *key, size_t keylen, char *path, size_t size) {
+	struct MD5Context ctx;
+	unsigned char digest[16];
+	int n = cache_dir(bucket, path, size);
+
+	if(n < 0 || (size_t)n + 34 >= size)
+		return -1;
+	MD5Init(&ctx);
+	MD5Update(&ctx, (unsigned char *)key, keylen);
+	MD5Final(digest, &ctx);
+	path[n++] = '/';
+	for(int i = 0; i < 16; i++)
+		n += sprintf(path + n, "%02x", digest[i]);
+	return n;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+	unsigned char *p = buf;
+	while(len > 0) {
+		ssize_t r = read(fd, p, len);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	while(len > 0) {
+		ssize_t r = write(fd, p, len);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int CollCacheLoad(const char *bucket, const void *key, size_t keylen, void *val, size_t vallen) {
+	char path[4096];
+	unsigned char *entry;
+	struct stat st;
+	int fd, hit = 0;
+
+	if(entry_path(bucket, key, keylen, path, sizeof(path)) < 0)
+		return 0;
+	if((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	if(fstat(fd, &st) == 0 && (size_t)st.st_size == keylen + vallen &&
+	   (entry = malloc(keylen + vallen)) != NULL) {
+		if(read_full(fd, entry, keylen + vallen) == 0 && memcmp(entry, key, keylen) == 0) {
+			memcpy(val, entry + keylen, vallen);
+			hit = 1;
+		}
+		free(entry);
+	}
+	close(fd);
+	return hit;
+}
+
+int CollCacheStore(const char *bucket, const void *key, size_t keylen, const void *val, size_t vallen) {
+	char path[4096], tmp[sizeof(path) + 16];
+	int n, fd, ok;
+
+	if((n = entry_path(bucket, key, keylen, path, sizeof(path))) < 0)
+		return -1;
+	path[n - 33] = '\0';
+	if(make_dirs(path) < 0)
+		return -1;
+	snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", path);
+	path[n - 33] = '/';
+	if((fd = mkstemp(tmp)) < 0)
+		return -1;
+	ok = write_full(fd, key, keylen) == 0 && write_full(fd, val, vallen) == 0;
+	if(close(fd) < 0)
+		ok = 0;
+	if(!ok || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+/* Small persistent key/value store shared by the prefix midstate cache and
+ * anything else that wants to remember expensive results between runs.
+ *
+ * Entries live under $COLL_JPEG_CACHE_DIR (default $XDG_CACHE_HOME/coll-jpeg,
+ * then ~/.cache/coll-jpeg), one file per entry in a per-bucket directory,
+ * named after the MD5 of the key. The key is stored alongside the value so
+ * a name clash or a truncated file reads back as a miss. Stores go through
+ * a temporary file and rename(), so concurrent readers never see a partial
+ * entry and concurrent writers of the same key simply race to the same
+ * content. */
+
+/* Returns 1 and fills val on a hit, 0 on a miss or any error. */
+extern int CollCacheLoad(const char *bucket, const void *key, size_t keylen, void *val, size_t vallen);
+/* Returns 0 on success, -1 on error. Failing to store is never fatal. */
+extern int CollCacheStore(const char *bucket, const void *key, size_t keylen, const void *val, size_t vallen);
+
+#endif /* !CACHE_H */
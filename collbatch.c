@@ -0,0 +1,109 @@
+/* collbatch: run a file of builds on one shared pool of search threads.
+ *
+ *   collbatch [-n] [-t THREADS] [-j JOBS] [JOBFILE]
+ *
+ * JOBFILE (default stdin) has one build per line, in the form given in
+ * batch.h; blank lines and lines starting with # are skipped. Up to JOBS
+ * builds (default one per search thread) run at once. As each one
+ * finishes a line goes to stdout:
+ *
+ *   ok LINE OUTDIR
+ *   error LINE MESSAGE
+ *
+ * where LINE is its line number in the job file. Exits 0 if every build
+ * succeeded.
+ */
+#include "batch.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct run {
+	struct CollBatchJob *jobs;
+	int *lines;
+	FILE *out;
+};
+
+static void job_done(void *arg, int index, int rc, const char *error) {
+	struct run *run = arg;
+	if(rc < 0)
+		fprintf(run->out, "error %d %s\n", run->lines[index], error);
+	else
+		fprintf(run->out, "ok %d %s\n", run->lines[index], run->jobs[index].outdir);
+	fflush(run->out);
+}
+
+int main(int argc, char **argv) {
+	struct run run = { NULL, NULL, NULL };
+	struct CollPool *pool;
+	FILE *in = stdin;
+	char *line = NULL;
+	size_t size = 0;
+	int threads = 0, concurrency = 0, cache = 1, opt, njobs = 0, lineno = 0, bad = 0;
+
+	while((opt = getopt(argc, argv, "nt:j:")) != -1) {
+		if(opt == 'n')
+			cache = 0;
+		else if(opt == 't')
+			threads = atoi(optarg);
+		else if(opt == 'j')
+			concurrency = atoi(optarg);
+		else
+			goto usage;
+	}
+	if(argc - optind > 1) {
+usage:
+		fprintf(stderr, "Usage: collbatch [-n] [-t THREADS] [-j JOBS] [JOBFILE]\n");
+		return 2;
+	}
+	if(optind < argc && (in = fopen(argv[optind], "r")) == NULL) {
+		perror(argv[optind]);
+		return 2;
+	}
+
+	while(getline(&line, &size, in) > 0) {
+		char *p = line + strspn(line, " \t\r\n");
+		lineno++;
+		if(*p == '\0' || *p == '#')
+			continue;
+		struct CollBatchJob *jobs = realloc(run.jobs, sizeof(*jobs) * (njobs + 1));
+		int *lines = realloc(run.lines, sizeof(*lines) * (njobs + 1));
+		if(jobs)
+			run.jobs = jobs;
+		if(lines)
+			run.lines = lines;
+		if(!jobs || !lines)
+			return 1;
+		if(CollBatchParse(p, &run.jobs[njobs]) < 0) {
+			fprintf(stderr, "collbatch: bad job on line %d\n", lineno);
+			bad = 1;
+			continue;
+		}
+		run.jobs[njobs].opts.cache = cache && run.jobs[njobs].opts.cache;
+		run.lines[njobs++] = lineno;
+	}
+	free(line);
+	if(bad)
+		return 2;
+	if(njobs == 0)
+		return 0;
+
+	// the searches print their progress on stdout; keep it for the results
+	if((run.out = fdopen(dup(STDOUT_FILENO), "w")) == NULL)
+		return 1;
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	if((pool = CollPoolCreate(threads)) == NULL) {
+		fprintf(stderr, "collbatch: can't start search threads\n");
+		return 1;
+	}
+	int failed = CollBatchRun(pool, run.jobs, njobs, concurrency, job_done, &run);
+	CollPoolDestroy(pool);
+	for(int i = 0; i < njobs; i++)
+		CollBatchJobFree(&run.jobs[i]);
+	free(run.jobs);
+	free(run.lines);
+	return failed ? 1 : 0;
+}
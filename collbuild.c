@@ -0,0 +1,116 @@
+/* collbuild: build a set of JPEGs that all have the same MD5.
+ *
+ *   collbuild [-n] [-v] [-s] [-t THREADS] [-i IV] [-p PREFIX] [-o POSITION]
+ *             [-b BADCHARS] [-m MANIFEST] [-H K] [-D MS] OUTDIR IMAGE1 IMAGE2 ..
+ *
+ * Writes one output per image into OUTDIR, named after it, or with -m just
+ * the last one plus a patch manifest for collmanifest. -p hashes the first
+ * POSITION bytes of PREFIX, which will come before the outputs; -i gives
+ * the midstate directly (32 hex digits, in the byte order of a digest).
+ * -b lists byte values the collision blocks can't contain, two hex digits
+ * each. -n skips the on-disk caches and -v checks every output's digest at
+ * the end. -H races K variants of each collision's padding and keeps the
+ * first to finish, starting the extra ones after MS milliseconds with -D;
+ * either way the time per collision and its p50/p99 go to stderr at the
+ * end, to compare. -s drops the images' metadata first (see jpegcoll.h),
+ * and -ss their ICC profiles too.
+ */
+#include "batch.h"
+#include "jpegcoll.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void progress(void *arg, int done, int total) {
+	fprintf(stderr, "collbuild: collision %d of %d\n", done, total);
+}
+
+static int by_value(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// nearest rank, so with few collisions p99 is just the slowest
+static void report_times(double *times, int n) {
+	for(int i = 0; i < n; i++)
+		fprintf(stderr, "collbuild: collision %d took %.3fs\n", i + 1, times[i]);
+	qsort(times, n, sizeof(*times), by_value);
+	fprintf(stderr, "collbuild: p50 %.3fs p99 %.3fs max %.3fs\n",
+	        times[(n * 50 + 99) / 100 - 1], times[(n * 99 + 99) / 100 - 1], times[n - 1]);
+}
+
+static int usage(void) {
+	fprintf(stderr, "Usage: collbuild [-n] [-v] [-s] [-t THREADS] [-i IV] [-p PREFIX] [-o POSITION]\n"
+	                "                 [-b BADCHARS] [-m MANIFEST] [-H K] [-D MS] OUTDIR IMAGE1 IMAGE2 ..\n");
+	return 2;
+}
+
+int main(int argc, char **argv) {
+	struct CollBuildOptions opts;
+	struct CollImage *images;
+	char badchars[256];
+	uint64_t saved = 0;
+	int opt, n;
+
+	CollBuildDefaults(&opts);
+	opts.progress = progress;
+	opts.saved = &saved;
+	while((opt = getopt(argc, argv, "nvst:i:p:o:b:m:H:D:")) != -1) {
+		switch(opt) {
+		case 'n':
+			opts.cache = 0;
+			break;
+		case 'v':
+			opts.verify = 1;
+			break;
+		case 's':
+			opts.slim++;
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'i':
+			if(CollParseIV(optarg, opts.iv) < 0)
+				return usage();
+			break;
+		case 'p':
+			opts.prefix = optarg;
+			break;
+		case 'o':
+			opts.position = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			if(CollParseBadchars(optarg, badchars) < 0)
+				return usage();
+			opts.badchars = badchars;
+			break;
+		case 'm':
+			opts.manifest = optarg;
+			break;
+		case 'H':
+			opts.hedge = atoi(optarg);
+			break;
+		case 'D':
+			opts.hedge_delay_ms = atoi(optarg);
+			break;
+		default:
+			return usage();
+		}
+	}
+	if(argc - optind < 3)
+		return usage();
+
+	n = argc - optind - 1;
+	if((images = calloc(n, sizeof(*images))) == NULL || (opts.times = calloc(n - 1, sizeof(double))) == NULL)
+		return 1;
+	for(int i = 0; i < n; i++)
+		images[i].path = argv[optind + 1 + i];
+	if(CollBuild(&opts, images, n, argv[optind]) < 0) {
+		fprintf(stderr, "collbuild: %s\n", CollBuildError());
+		return 1;
+	}
+	if(opts.slim)
+		fprintf(stderr, "collbuild: slimming saved %llu bytes\n", (unsigned long long)saved);
+	report_times(opts.times, n - 1);
+	return 0;
+}
@@ -0,0 +1,49 @@
+/* collclient: send one request to colld and print the replies.
+ *
+ *   collclient SOCKET find IV [priority=N] [badchars=HEX]
+ *   collclient SOCKET prefix PATH LEN [priority=N] [badchars=HEX]
+ *   collclient SOCKET build OUTDIR IMAGE1 IMAGE2 .. [OPTION=VALUE ..]
+ *
+ * Progress goes to stderr and the final line to stdout. Exits 0 when the
+ * job is done, 1 otherwise.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char line[8192];
+	FILE *in;
+	int fd;
+
+	if(argc < 3 || strlen(argv[1]) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Usage: collclient SOCKET find IV [priority=N] [badchars=HEX]\n"
+		                "       collclient SOCKET prefix PATH LEN [priority=N] [badchars=HEX]\n"
+		                "       collclient SOCKET build OUTDIR IMAGE1 IMAGE2 .. [OPTION=VALUE ..]\n");
+		return 2;
+	}
+	strcpy(addr.sun_path, argv[1]);
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	   connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("collclient");
+		return 1;
+	}
+	for(int i = 2; i < argc; i++)
+		dprintf(fd, "%s%c", argv[i], i == argc - 1 ? '\n' : ' ');
+
+	if((in = fdopen(fd, "r")) == NULL)
+		return 1;
+	while(fgets(line, sizeof(line), in)) {
+		if(strncmp(line, "queued ", 7) == 0 || strncmp(line, "progress ", 9) == 0) {
+			fputs(line, stderr);
+			continue;
+		}
+		fputs(line, stdout);
+		return strncmp(line, "done ", 5) != 0;
+	}
+	fprintf(stderr, "collclient: connection closed\n");
+	return 1;
+}
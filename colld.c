@@ -0,0 +1,304 @@
+/* colld: keep a pool of collision search threads warm and take jobs over
+ * a Unix socket, so a pipeline can queue many collisions without paying
+ * for a process (and a Ruby interpreter) per search.
+ *
+ *   colld [-n] [-t THREADS] SOCKET
+ *
+ * The protocol is line based. A client sends one request per line:
+ *
+ *   find IV [priority=N] [badchars=HEX] [cache=0]
+ *   prefix PATH LEN [priority=N] [badchars=HEX] [cache=0]
+ *   build OUTDIR IMAGE1 IMAGE2 .. [iv=IV] [prefix=PATH] [position=N]
+ *         [manifest=PATH] [verify=1] [priority=N] [badchars=HEX]
+ *         [hedge=K] [hedge_delay=MS] [slim=LEVEL] [cache=0]
+ *
+ * IV is the chaining value as 32 hex digits, in the byte order of a digest;
+ * prefix hashes the first LEN bytes of PATH (a whole number of blocks) from
+ * the standard IV. badchars lists byte values the blocks may not contain,
+ * two hex digits each. build runs a whole CollBuild from a job line as in
+ * batch.h; paths are as the daemon sees them and can't contain spaces.
+ * Jobs from all connections share the pool, highest priority first
+ * (default 0) and spread evenly otherwise. The reply is
+ *
+ *   queued ID
+ *   progress ID workers=N block0s=N elapsed=MS	(every second)
+ *   done ID BLOCKS		(256 hex digits: blocks 0 and 1 of message A)
+ *
+ * or for build
+ *
+ *   queued ID
+ *   progress ID collision=K/N	(after each collision)
+ *   done ID BASE		(the output every other one is a clone of)
+ *
+ * or "error MESSAGE". Requests on one connection are answered in turn;
+ * closing the connection cancels its job. Collisions are looked up in and
+ * saved to the on-disk cache (cache.h) unless -n is given, or cache=0 for
+ * one request.
+ *
+ * Anyone who can connect can have colld read and write files as its own
+ * user, so the socket is created for its owner only (mode 0600); loosen it
+ * with chmod if other users are to share the daemon. An existing socket at
+ * SOCKET is replaced, but anything else there is left alone.
+ */
+#include "batch.h"
+#include "md5.h"
+#include "pool.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static struct CollPool *pool;
+static int use_cache = 1;
+static int next_id;
+
+// nonzero once the client has hung up
+static int client_gone(int fd) {
+	struct pollfd p = { fd, POLLIN, 0 };
+	char c;
+	if(poll(&p, 1, 0) <= 0)
+		return 0;
+	if(p.revents & (POLLHUP | POLLERR))
+		return 1;
+	return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+static void run_job(int fd, const uint32_t iv[4], const char *badchars, int priority, int cache) {
+	int id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+	struct CollJob *job = CollPoolSubmit(pool, iv, badchars, priority, cache ? MD5_COLLISION_CACHE : 0);
+	struct CollJobStatus status;
+	uint32_t blocks[32];
+
+	if(!job) {
+		dprintf(fd, "error out of memory\n");
+		return;
+	}
+	dprintf(fd, "queued %d\n", id);
+	// wake for the job finishing, the client hanging up or a progress tick
+	struct pollfd fds[2] = { { CollJobFd(job), POLLIN, 0 }, { fd, POLLIN, 0 } };
+	while(CollJobPoll(job) < COLL_JOB_DONE) {
+		int r = poll(fds, 2, 1000);
+		if(r < 0 && errno != EINTR)
+			break;
+		if(r > 0 && fds[1].revents) {
+			if(client_gone(fd))
+				break;
+			// the next request, already sent; it waits its turn, but a
+			// hangup still shows as POLLHUP with no events asked for
+			fds[1].events = 0;
+		}
+		if(r != 0)
+			continue;
+		CollJobGetStatus(job, &status);
+		dprintf(fd, "progress %d workers=%d block0s=%llu elapsed=%llu\n", id,
+		        status.workers, (unsigned long long)status.block0s, (unsigned long long)status.elapsed_ms);
+	}
+	if(CollJobResult(job, blocks) == 0) {
+		unsigned char bytes[128];
+		char hex[257];
+		for(int i = 0; i < 32; i++) {
+			for(int j = 0; j < 4; j++)
+				bytes[4*i + j] = blocks[i] >> 8*j;
+		}
+		for(int i = 0; i < 128; i++)
+			sprintf(hex + 2*i, "%02x", bytes[i]);
+		dprintf(fd, "done %d %s\n", id, hex);
+	}
+	CollJobRelease(job);
+}
+
+static void build_progress(void *arg, int done, int total) {
+	int *client = arg;
+	dprintf(client[0], "progress %d collision=%d/%d\n", client[1], done, total);
+}
+
+static void run_build(int fd, const char *request) {
+	int id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+	int client[2] = { fd, id };
+	struct CollBatchJob job;
+
+	if(CollBatchParse(request, &job) < 0) {
+		dprintf(fd, "error bad request\n");
+		return;
+	}
+	job.opts.pool = pool;
+	job.opts.cache = use_cache && job.opts.cache;
+	job.opts.progress = build_progress;
+	job.opts.progress_arg = client;
+	struct CollBuildJob *build = CollBuildStart(&job.opts, job.images, job.nimages, job.outdir);
+	if(!build) {
+		dprintf(fd, "error %s\n", CollBuildError());
+		CollBatchJobFree(&job);
+		return;
+	}
+	dprintf(fd, "queued %d\n", id);
+	// as for run_job: a client that hangs up takes its build with it
+	struct pollfd fds[2] = { { CollBuildFd(build), POLLIN, 0 }, { fd, POLLIN, 0 } };
+	while(!fds[0].revents) {
+		if(poll(fds, 2, -1) < 0 && errno != EINTR)
+			break;
+		if(fds[1].revents) {
+			if(client_gone(fd)) {
+				CollBuildCancel(build);
+				break;
+			}
+			fds[1].events = 0;
+		}
+	}
+	if(CollBuildFinish(build) < 0) {
+		dprintf(fd, "error %s\n", CollBuildError());
+	} else {
+		const char *last = job.images[job.nimages - 1].path;
+		dprintf(fd, "done %d %s/%s\n", id, job.outdir, strrchr(last, '/') ? strrchr(last, '/') + 1 : last);
+	}
+	CollBatchJobFree(&job);
+}
+
+static void handle_request(int fd, char *line) {
+	struct CollBuildOptions opts;
+	char badchars[256];
+	char **args = NULL;
+	int nargs = 0;
+	uint32_t iv[4];
+
+	// build takes the same job line as collbatch
+	line += strspn(line, " \t");
+	if(strncmp(line, "build", 5) == 0 && strchr(" \t", line[5])) {
+		run_build(fd, line + 5);
+		return;
+	}
+
+	CollBuildDefaults(&opts);
+	for(char *save, *w = strtok_r(line, " \t\r\n", &save); w; w = strtok_r(NULL, " \t\r\n", &save)) {
+		if(strchr(w, '=')) {
+			if(CollBuildOption(w, &opts, badchars) < 0) {
+				dprintf(fd, "error bad option %s\n", w);
+				goto done;
+			}
+			continue;
+		}
+		char **more = realloc(args, sizeof(*args) * (nargs + 1));
+		if(!more) {
+			dprintf(fd, "error out of memory\n");
+			goto done;
+		}
+		args = more;
+		args[nargs++] = w;
+	}
+	if(nargs == 0)
+		goto done;
+
+	if(strcmp(args[0], "find") == 0 && nargs == 2) {
+		if(CollParseIV(args[1], iv) < 0) {
+			dprintf(fd, "error bad iv\n");
+			goto done;
+		}
+		run_job(fd, iv, opts.badchars, opts.priority, use_cache && opts.cache);
+	} else if(strcmp(args[0], "prefix") == 0 && nargs == 3) {
+		struct MD5Context ctx;
+		char *end;
+		unsigned long long len = strtoull(args[2], &end, 10);
+		if(*end || len % 64) {
+			dprintf(fd, "error prefix length must be a whole number of blocks\n");
+			goto done;
+		}
+		MD5Init(&ctx);
+		if(MD5PrefixContext(&ctx, args[1], len, use_cache && opts.cache ? MD5_PREFIX_CACHE : 0) < 0) {
+			dprintf(fd, "error can't hash %s\n", args[1]);
+			goto done;
+		}
+		run_job(fd, ctx.buf, opts.badchars, opts.priority, use_cache && opts.cache);
+	} else {
+		dprintf(fd, "error bad request\n");
+	}
+done:
+	free(args);
+}
+
+static void *client_thread(void *arg) {
+	int fd = (int)(intptr_t)arg;
+	FILE *in = fdopen(dup(fd), "r");
+	char *line = NULL;
+	size_t size = 0;
+
+	while(in && getline(&line, &size, in) > 0)
+		handle_request(fd, line);
+	free(line);
+	if(in)
+		fclose(in);
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+	int threads = 0, opt, listener;
+	mode_t mask;
+
+	while((opt = getopt(argc, argv, "nt:")) != -1) {
+		if(opt == 'n')
+			use_cache = 0;
+		else if(opt == 't')
+			threads = atoi(optarg);
+		else
+			goto usage;
+	}
+	if(optind != argc - 1 || strlen(argv[optind]) >= sizeof(addr.sun_path)) {
+usage:
+		fprintf(stderr, "Usage: colld [-n] [-t THREADS] SOCKET\n");
+		return 2;
+	}
+	strcpy(addr.sun_path, argv[optind]);
+
+	signal(SIGPIPE, SIG_IGN);
+	if((pool = CollPoolCreate(threads)) == NULL) {
+		fprintf(stderr, "colld: can't start search threads\n");
+		return 1;
+	}
+	// a stale socket from an earlier run, but never a file given by mistake
+	if(lstat(addr.sun_path, &st) == 0) {
+		if(!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "colld: %s exists and isn't a socket\n", addr.sun_path);
+			return 1;
+		}
+		unlink(addr.sun_path);
+	}
+	if((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("colld");
+		return 1;
+	}
+	mask = umask(0177);
+	if(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("colld");
+		return 1;
+	}
+	umask(mask);
+	if(listen(listener, 64) < 0) {
+		perror("colld");
+		return 1;
+	}
+	fprintf(stderr, "colld: %d search threads on %s\n", CollPoolThreads(pool), addr.sun_path);
+
+	for(;;) {
+		pthread_t thread;
+		int fd = accept(listener, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("colld");
+			return 1;
+		}
+		if(pthread_create(&thread, NULL, client_thread, (void *)(intptr_t)fd) != 0)
+			close(fd);
+		else
+			pthread_detach(thread);
+	}
+}
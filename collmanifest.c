@@ -0,0 +1,56 @@
+/* collmanifest: inspect a patch manifest and materialise its variants.
+ *
+ *   collmanifest list MANIFEST
+ *   collmanifest get MANIFEST VARIANT [OUTPUT]
+ *
+ * VARIANT is a variant name or index. Without OUTPUT the variant is
+ * streamed to stdout.
+ */
+#include "manifest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int usage(void) {
+	fprintf(stderr, "Usage: collmanifest list MANIFEST\n"
+	                "       collmanifest get MANIFEST VARIANT [OUTPUT]\n");
+	return 2;
+}
+
+int main(int argc, char **argv) {
+	struct CollManifest *m;
+	int r = 0;
+
+	if(argc < 3)
+		return usage();
+	if((m = CollManifestRead(argv[2])) == NULL) {
+		fprintf(stderr, "collmanifest: can't read manifest %s\n", argv[2]);
+		return 1;
+	}
+
+	if(strcmp(argv[1], "list") == 0 && argc == 3) {
+		printf("base %s\n", m->base);
+		for(int i = 0; i < m->nvariants; i++)
+			printf("%d %s (%d patches)\n", i, m->variants[i].name, m->variants[i].npatches);
+	} else if(strcmp(argv[1], "get") == 0 && (argc == 4 || argc == 5)) {
+		char *end;
+		int v = CollManifestFind(m, argv[3]);
+		if(v < 0) {
+			v = strtol(argv[3], &end, 10);
+			if(*argv[3] == '\0' || *end != '\0')
+				v = -1;
+		}
+		if(v < 0 || v >= m->nvariants) {
+			fprintf(stderr, "collmanifest: no variant %s\n", argv[3]);
+			r = 1;
+		} else if((argc == 5 ? CollMaterialise(m, v, argv[4]) : CollMaterialiseFd(m, v, STDOUT_FILENO)) < 0) {
+			perror("collmanifest");
+			r = 1;
+		}
+	} else {
+		r = usage();
+	}
+	CollManifestFree(m);
+	return r;
+}
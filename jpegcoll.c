@@ -0,0 +1,924 @@
+/* The multi-collision JPEG builder.
+ *
+ * For images A, B, .. Z the base output is
+ *
+ *   [SOI] per image but the last:
+ *         [COM len][ALIGN][CBLOCK0][CBLOCK1][PAD A][COM jump][PAD B][image]
+ *   then [Z]
+ *
+ * where the collision blocks end in a COM marker whose length byte differs
+ * by 128 between the two messages. With message A the decoder's comment
+ * ends at the jump comment, which skips this image (in relays if it's
+ * bigger than a segment, see relay_plan) and goes on to the next collision;
+ * with message B the comment runs over the jump and the decoder lands on
+ * the image itself. Every collision is searched from the midstate of
+ * everything written before it, so each one needs the previous one.
+ *
+ * A Joux-style tree (k chained collisions giving 2^k images) doesn't work
+ * here, 64 KiB comments or not. All the paths share every byte except the
+ * collision blocks, and the only thing a JPEG decoder carries through COM
+ * segments is its file position. The only byte a collision can change for
+ * the parser is the comment length at a fixed offset in its block, so every
+ * path that reads it is at the same position and from then on
+ * indistinguishable, and a path that skips it doesn't see the choice at
+ * all. Each collision can only split one path, so N images need N-1
+ * collisions whatever the layout; instead each search is raced over all
+ * cores (MD5FindCollision, or the pool), and with hedge over padding
+ * variants too.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include "jpegcoll.h"
+#include "manifest.h"
+#include "md5.h"
+#include "pool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SEGMENT 65535
+// where the COM marker sits in the first collision block
+#define COMMENT_OFFSET 56
+// the comment's length counts its length field; it must at least reach past both blocks
+#define MIN_COMMENT (128 - (COMMENT_OFFSET + 2))
+// padding variants raced per collision at most
+#define MAX_HEDGE 16
+
+// a 4-byte comment to the image's own decoder, holding a jump for the other one
+static const unsigned char relay_comment[4] = { 0xff, 0xfe, 0x00, 0x06 };
+
+static __thread char build_error[512];
+
+static int fail(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(build_error, sizeof(build_error), fmt, ap);
+	va_end(ap);
+	return -1;
+}
+
+const char *CollBuildError(void) {
+	return build_error;
+}
+
+void CollBuildDefaults(struct CollBuildOptions *opts) {
+	static const uint32_t md5_iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	memset(opts, 0, sizeof(*opts));
+	memcpy(opts->iv, md5_iv, sizeof(opts->iv));
+	opts->cache = 1;
+	opts->cancel_fd = -1;
+}
+
+static int cancelled(const struct CollBuildOptions *opts) {
+	struct pollfd p = { opts->cancel_fd, POLLIN, 0 };
+	return opts->cancel_fd >= 0 && poll(&p, 1, 0) > 0;
+}
+
+/* The output file, hashed on top of the prefix midstate as it's written.
+ * Images go straight from their mapping to write(). */
+struct hashed_out {
+	int fd;
+	uint64_t size;
+	struct MD5Context ctx;
+};
+
+static int out_write(struct hashed_out *out, const void *data, size_t len) {
+	const unsigned char *p = data;
+	MD5Update(&out->ctx, (unsigned char *)p, len);
+	out->size += len;
+	while(len > 0) {
+		ssize_t w = write(out->fd, p, len);
+		if(w < 0 && errno == EINTR)
+			continue;
+		if(w <= 0)
+			return -1;
+		p += w;
+		len -= w;
+	}
+	return 0;
+}
+
+static int out_zeros(struct hashed_out *out, size_t len) {
+	static const unsigned char zeros[256];
+	while(len > 0) {
+		size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+		if(out_write(out, zeros, n) < 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static int out_be16(struct hashed_out *out, unsigned int marker, unsigned int len) {
+	unsigned char b[4] = { 0xff, marker, len >> 8, len };
+	return out_write(out, b, 4);
+}
+
+/* The end of the piece of JPEG starting at p that can't be cut: a marker
+ * segment, or an SOS segment together with its entropy-coded data (up to
+ * the next marker other than RSTn). 0 if it's truncated. */
+static size_t unit_end(const unsigned char *d, size_t p, size_t n) {
+	// data after EOI, keep it in one piece
+	if(d[p] != 0xff)
+		return n;
+	while(p + 1 < n && d[p + 1] == 0xff)
+		p++;
+	if(p + 1 >= n)
+		return 0;
+	unsigned int marker = d[p + 1];
+	p += 2;
+	if(marker == 0x01 || (marker >= 0xd0 && marker <= 0xd9))
+		return p;
+	if(p + 2 > n)
+		return 0;
+	p += d[p] << 8 | d[p + 1];
+	// the SOS header too, before looking for the end of its scan
+	if(p > n)
+		return 0;
+	if(marker == 0xda) {
+		const unsigned char *ff;
+		while(p < n && (ff = memchr(d + p, 0xff, n - p)) != NULL) {
+			size_t f = ff - d;
+			if(f + 1 >= n)
+				return n;
+			unsigned int next = d[f + 1];
+			if(next == 0x00 || (next >= 0xd0 && next <= 0xd7))
+				p = f + 2;
+			else if(next == 0xff)
+				p = f + 1;
+			else
+				return f;
+		}
+		return n;
+	}
+	return p;
+}
+
+/* A run of an image's bytes as they go out; slimming leaves gaps between
+ * them, at unit boundaries. */
+struct span {
+	const unsigned char *data;
+	size_t len;
+};
+
+/* A COM segment skips at most 65533 bytes, so a bigger image is cut into
+ * pieces at unit boundaries with a relay between each:
+ *
+ *   [piece 1][FF FE 00 06 [FF FE len2]][piece 2][FF FE 00 06 [FF FE len3]] ..
+ *
+ * The image's decoder sees an ordinary comment; the jumping decoder lands
+ * inside it on another COM header that takes it over the next piece. lead
+ * is how much of the first jump comes before the image, counting its length
+ * field. Fills in the piece and jump lengths and returns the number of
+ * pieces, or -1. */
+static int relay_plan(const struct span *spans, int nspans, size_t lead, size_t *pieces, unsigned int *jumps) {
+	int npieces = 1;
+	size_t used = lead;
+
+	pieces[0] = 0;
+	for(int s = 0; s < nspans; s++) {
+		const unsigned char *d = spans[s].data;
+		size_t n = spans[s].len;
+		for(size_t p = 0; p < n; ) {
+			size_t end = unit_end(d, p, n);
+			if(end == 0)
+				return fail("truncated jpeg");
+			size_t len = end - p;
+			if(used + len + sizeof(relay_comment) > MAX_SEGMENT && pieces[npieces - 1] != 0) {
+				pieces[npieces++] = 0;
+				used = 2;
+			}
+			if(used + len + sizeof(relay_comment) > MAX_SEGMENT)
+				return fail("image has a %zu byte segment or scan, too big to jump over; "
+				            "re-encode it with smaller scans (e.g. jpegtran -progressive)", len);
+			pieces[npieces - 1] += len;
+			used += len;
+			p = end;
+		}
+	}
+	for(int i = 0; i < npieces; i++)
+		jumps[i] = (i == 0 ? lead : 2) + pieces[i] + (i == npieces - 1 ? 0 : sizeof(relay_comment));
+	return npieces;
+}
+
+// the pieces, taken in order from the spans
+static int write_relayed(struct hashed_out *out, const struct span *spans, const size_t *pieces, const unsigned int *jumps, int npieces) {
+	size_t offset = 0;
+	for(int i = 0; i < npieces; i++) {
+		if(i > 0 && (out_write(out, relay_comment, sizeof(relay_comment)) < 0 ||
+		             out_be16(out, 0xfe, jumps[i]) < 0))
+			return -1;
+		for(size_t left = pieces[i]; left > 0; ) {
+			size_t n = spans->len - offset < left ? spans->len - offset : left;
+			if(out_write(out, spans->data + offset, n) < 0)
+				return -1;
+			left -= n;
+			offset += n;
+			if(offset == spans->len) {
+				spans++;
+				offset = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/* An image is only mapped while it's being appended, so however many
+ * there are and however big, only one is in memory at a time. */
+struct image {
+	const struct CollImage *src;
+	const unsigned char *data;	/* after the SOI, while open */
+	size_t len;		/* of what gets written */
+	struct span *spans;	/* what gets written: whole, or slim_image's */
+	int nspans;
+	struct span whole;
+	void *map;
+	size_t maplen;
+	char name[NAME_MAX + 1];
+};
+
+static int is_jpeg(const unsigned char *d, size_t len) {
+	return len >= 2 && d[0] == 0xff && d[1] == 0xd8;
+}
+
+// everything that can be checked before the first collision: the name and the SOI
+static int check_image(const struct CollImage *src, struct image *img) {
+	const char *name = src->name;
+	unsigned char soi[2];
+	memset(img, 0, sizeof(*img));
+	img->src = src;
+	if(!name) {
+		if(!src->path)
+			return fail("image without a name");
+		name = strrchr(src->path, '/') ? strrchr(src->path, '/') + 1 : src->path;
+	}
+	if(strlen(name) >= sizeof(img->name) || !*name || strchr(name, '/'))
+		return fail("bad output name %s", name);
+	strcpy(img->name, name);
+
+	if(src->data)
+		return is_jpeg(src->data, src->len) ? 0 : fail("not a jpeg: %s", name);
+	int fd = open(src->path, O_RDONLY);
+	if(fd < 0)
+		return fail("can't read %s: %s", src->path, strerror(errno));
+	ssize_t n = pread(fd, soi, sizeof(soi), 0);
+	close(fd);
+	return n == sizeof(soi) && is_jpeg(soi, n) ? 0 : fail("not a jpeg: %s", name);
+}
+
+static int open_image(struct image *img) {
+	const struct CollImage *src = img->src;
+	if(src->data) {
+		img->data = src->data;
+		img->len = src->len;
+	} else {
+		struct stat st;
+		int fd = open(src->path, O_RDONLY);
+		if(fd < 0 || fstat(fd, &st) < 0) {
+			if(fd >= 0)
+				close(fd);
+			return fail("can't read %s: %s", src->path, strerror(errno));
+		}
+		void *map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		close(fd);
+		if(map == MAP_FAILED)
+			return fail("can't map %s", src->path);
+		img->map = map;
+		img->maplen = st.st_size;
+		madvise(img->map, img->maplen, MADV_SEQUENTIAL);
+		img->data = img->map;
+		img->len = img->maplen;
+	}
+	// it may have changed since check_image
+	if(!is_jpeg(img->data, img->len))
+		return fail("not a jpeg: %s", img->name);
+	img->data += 2;
+	img->len -= 2;
+	img->whole = (struct span){ img->data, img->len };
+	img->spans = &img->whole;
+	img->nspans = 1;
+	return 0;
+}
+
+static void close_image(struct image *img) {
+	if(img->map)
+		munmap(img->map, img->maplen);
+	if(img->spans != &img->whole)
+		free(img->spans);
+	img->map = NULL;
+	img->spans = NULL;
+	img->data = NULL;
+}
+
+// Start the kernel reading an image in while the collision before it is
+// searched, so it's in the page cache by the time it's mapped.
+static void prefetch_image(const struct image *img) {
+	int fd;
+	if(img->src->data || (fd = open(img->src->path, O_RDONLY)) < 0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+// whether a decoder needs the segment with this marker to draw the image
+static int keep_segment(int level, unsigned int marker, const unsigned char *body, size_t len) {
+	if(marker == 0xfe)
+		return 0;
+	if(marker < 0xe0 || marker > 0xef)
+		return 1;
+	// JFIF, and Adobe's, which says how the colours were transformed
+	if(marker == 0xe0 || marker == 0xee)
+		return 1;
+	if(marker == 0xe2 && level < 2 && len >= 12 && memcmp(body, "ICC_PROFILE", 12) == 0)
+		return 1;
+	return 0;
+}
+
+// Leave the metadata segments before the image's first scan out of its
+// spans; from there on it's written exactly as it was, straight from the
+// mapping. Returns the bytes saved, or 0 with the image untouched if
+// there's nothing to drop or it doesn't parse.
+static size_t slim_image(struct image *img, int level) {
+	const unsigned char *d = img->data;
+	size_t n = img->len, p = 0, q = 0;
+	struct span *spans = NULL;
+	int nspans = 0, maxspans = 0;
+
+	while(p + 4 <= n && d[p] == 0xff) {
+		unsigned int marker = d[p + 1], len = d[p + 2] << 8 | d[p + 3];
+		if(marker == 0xda || marker == 0xd9)
+			break;
+		if(marker == 0xff) {
+			// fill byte
+			p++;
+			continue;
+		}
+		if(len < 2 || len > n - p - 2)
+			goto bad;
+		if(keep_segment(level, marker, d + p + 4, len - 2)) {
+			if(nspans > 0 && spans[nspans - 1].data + spans[nspans - 1].len == d + p) {
+				spans[nspans - 1].len += 2 + len;
+			} else {
+				// room for this one and the rest of the image after it
+				if(nspans + 2 > maxspans) {
+					struct span *more = realloc(spans, sizeof(*spans) * (maxspans = 2 * maxspans + 8));
+					if(!more)
+						goto bad;
+					spans = more;
+				}
+				spans[nspans++] = (struct span){ d + p, 2 + len };
+			}
+			q += 2 + len;
+		}
+		p += 2 + len;
+	}
+	if(p + 2 > n || d[p] != 0xff || (d[p + 1] != 0xda && d[p + 1] != 0xd9) || p == q)
+		goto bad;
+	if(!spans && (spans = malloc(sizeof(*spans))) == NULL)
+		goto bad;
+	if(nspans > 0 && spans[nspans - 1].data + spans[nspans - 1].len == d + p)
+		spans[nspans - 1].len += n - p;
+	else
+		spans[nspans++] = (struct span){ d + p, n - p };
+	img->spans = spans;
+	img->nspans = nspans;
+	img->len = q + (n - p);
+	return n - img->len;
+bad:
+	free(spans);
+	return 0;
+}
+
+// map an image for appending, slimmed if asked
+static int load_image(const struct CollBuildOptions *opts, struct image *img, uint64_t *saved) {
+	if(open_image(img) < 0)
+		return -1;
+	if(opts->slim)
+		*saved += slim_image(img, opts->slim);
+	return 0;
+}
+
+// The alignment padding is comment data, so its last byte is free, and
+// each value of it gives the collision a different IV. Search times have a
+// long tail that depends on the IV, so with opts->hedge > 1 that many
+// variants race on the pool (the rest once the first has run for
+// hedge_delay_ms) and the first to finish wins. They go in as variants of
+// the first, so together they get one search's share of a busy pool. pad
+// holds the padding, zeros to start with; the winner's last byte is left
+// in it. On a pool the wait also watches opts->cancel_fd.
+static int search_padding(const struct CollBuildOptions *opts, const struct MD5Context *ctx,
+                          unsigned char *pad, size_t align, uint32_t blocks[32]) {
+	struct CollJob *jobs[MAX_HEDGE] = { NULL };
+	struct pollfd fds[MAX_HEDGE + 1];
+	uint32_t ivs[MAX_HEDGE][4];
+	int flags = opts->cache ? MD5_COLLISION_CACHE : 0;
+	int k = opts->hedge < 1 ? 1 : opts->hedge > MAX_HEDGE ? MAX_HEDGE : opts->hedge;
+	int n = 0, winner = -1, rc = -1, delayed;
+
+	for(int j = 0; j < k; j++) {
+		struct MD5Context variant = *ctx;
+		pad[align - 1] = j;
+		MD5Update(&variant, pad, align);
+		if(variant.bits[0] % 512 != 0)
+			return fail("collision block not aligned");
+		memcpy(ivs[j], variant.buf, sizeof(ivs[j]));
+	}
+	pad[align - 1] = 0;
+	if(!opts->pool)
+		return MD5FindCollision(ivs[0], blocks, opts->badchars, opts->threads, flags) < 0 ?
+		       fail("collision search failed") : 0;
+
+	// variant 0 first, which is what an unhedged build would search (and
+	// maybe has cached); the others only if it turns out to be slow
+	if((jobs[n++] = CollPoolSubmit(opts->pool, ivs[0], opts->badchars, opts->priority, flags)) == NULL)
+		goto done;
+	delayed = k > 1 && opts->hedge_delay_ms > 0;
+	for(;;) {
+		if(!delayed && n < k && CollJobPoll(jobs[0]) != COLL_JOB_DONE) {
+			for(; n < k; n++) {
+				if((jobs[n] = CollPoolSubmitVariant(jobs[0], ivs[n], flags)) == NULL)
+					goto done;
+			}
+		}
+		for(int j = 0; j < n; j++) {
+			int state = CollJobPoll(jobs[j]);
+			if(state == COLL_JOB_DONE) {
+				winner = j;
+				break;
+			}
+			// only the pool going away cancels them
+			if(state == COLL_JOB_CANCELLED)
+				goto done;
+		}
+		if(winner >= 0)
+			break;
+		for(int j = 0; j < n; j++)
+			fds[j] = (struct pollfd){ .fd = CollJobFd(jobs[j]), .events = POLLIN };
+		fds[n] = (struct pollfd){ .fd = opts->cancel_fd, .events = POLLIN };
+		int r = poll(fds, n + 1, delayed ? opts->hedge_delay_ms : -1);
+		if(r < 0 && errno != EINTR)
+			goto done;
+		if(r > 0 && fds[n].revents) {
+			rc = fail("cancelled");
+			goto done;
+		}
+		if(r == 0)
+			delayed = 0;
+	}
+	if(CollJobResult(jobs[winner], blocks) == 0) {
+		pad[align - 1] = winner;
+		rc = 0;
+	}
+done:
+	// the losers stop as soon as they're let go
+	for(int j = 0; j < n; j++) {
+		if(jobs[j])
+			CollJobRelease(jobs[j]);
+	}
+	if(rc < 0 && !cancelled(opts))
+		fail("collision search failed");
+	return rc;
+}
+
+// one collision and the image it hides; returns the patch for the image's own output
+static int append_image(const struct CollBuildOptions *opts, struct hashed_out *out, const struct image *img, struct CollPatch *patch) {
+	uint32_t blocks[32];
+	unsigned char a[128], b[128], pad[64];
+	size_t align = 64 - (opts->position + out->size + 4) % 64;
+	size_t *pieces = NULL;
+	unsigned int *jumps = NULL;
+	int npieces, rc = -1;
+
+	// the comment runs from its length field up to the marker in the first collision block
+	if(out_be16(out, 0xfe, 2 + align + COMMENT_OFFSET) < 0)
+		return fail("write failed: %s", strerror(errno));
+	memset(pad, 0, align);
+	if(search_padding(opts, &out->ctx, pad, align, blocks) < 0)
+		return -1;
+	if(out_write(out, pad, align) < 0)
+		return fail("write failed: %s", strerror(errno));
+	MD5CollisionMessages(blocks, a, b);
+
+	if(memcmp(a + COMMENT_OFFSET, "\xff\xfe\x00", 3) || memcmp(b + COMMENT_OFFSET, "\xff\xfe\x00", 3))
+		return fail("missing comment block");
+	if(!MD5VerifyCollision(out->ctx.buf, a, b))
+		return fail("digest mismatch");
+	// the shorter comment goes in the base
+	unsigned char *shorter = a[COMMENT_OFFSET + 3] < b[COMMENT_OFFSET + 3] ? a : b;
+	unsigned char *longer = shorter == a ? b : a;
+	unsigned int comment_a = shorter[COMMENT_OFFSET + 3], comment_b = longer[COMMENT_OFFSET + 3];
+	if(comment_b - comment_a != 128)
+		return fail("wrong size difference: %u %u", comment_b, comment_a);
+	if(comment_a < MIN_COMMENT)
+		return fail("comment size not large enough: %u", comment_a);
+
+	patch->position = out->size;
+	memcpy(patch->block, longer, 128);
+	if(out_write(out, shorter, 128) < 0 || out_zeros(out, comment_a - MIN_COMMENT) < 0)
+		return fail("write failed: %s", strerror(errno));
+
+	// comment B ends this far past the jump comment's length field, where the image starts
+	size_t comment_b_padding = comment_b - (comment_a + 4);
+	// relay_plan only starts a piece when the next unit won't fit in the one
+	// before, so any two pieces in a row hold more than MAX_SEGMENT - 6
+	size_t maxpieces = 2 * img->len / (MAX_SEGMENT - 6) + 2;
+	if((pieces = malloc(sizeof(*pieces) * maxpieces)) == NULL ||
+	   (jumps = malloc(sizeof(*jumps) * maxpieces)) == NULL) {
+		fail("out of memory");
+		goto done;
+	}
+	if((npieces = relay_plan(img->spans, img->nspans, 2 + comment_b_padding, pieces, jumps)) < 0)
+		goto done;
+	if(out_be16(out, 0xfe, jumps[0]) < 0 || out_zeros(out, comment_b_padding) < 0 ||
+	   write_relayed(out, img->spans, pieces, jumps, npieces) < 0) {
+		fail("write failed: %s", strerror(errno));
+		goto done;
+	}
+	rc = 0;
+done:
+	free(pieces);
+	free(jumps);
+	return rc;
+}
+
+static int verify_outputs(char **paths, int n) {
+	unsigned char *digests = malloc(16 * n);
+	int rc = -1;
+	if(!digests)
+		return fail("out of memory");
+	if(MD5HashFiles((const char *const *)paths, n, digests, 0) < 0)
+		fail("could not read outputs");
+	else
+		rc = 0;
+	for(int i = 1; rc == 0 && i < n; i++) {
+		if(memcmp(digests, digests + 16*i, 16) != 0)
+			rc = fail("output digest mismatch: %s", paths[i]);
+	}
+	free(digests);
+	return rc;
+}
+
+// base path as the manifest should record it: bare if they're in the same directory
+static void manifest_base(const char *manifest, const char *base, char *out, size_t size) {
+	char dir[PATH_MAX], mdir[PATH_MAX], copy[PATH_MAX];
+	snprintf(copy, sizeof(copy), "%s", manifest);
+	char *slash = strrchr(copy, '/');
+	if(slash)
+		*slash = '\0';
+	if(realpath(slash ? copy : ".", mdir) && realpath(base, dir)) {
+		size_t len = strlen(mdir);
+		if(strncmp(dir, mdir, len) == 0 && dir[len] == '/' && !strchr(dir + len + 1, '/')) {
+			snprintf(out, size, "%s", dir + len + 1);
+			return;
+		}
+		snprintf(out, size, "%s", dir);
+		return;
+	}
+	snprintf(out, size, "%s", base);
+}
+
+// Read the manifest back and materialise every variant from it, so the check
+// covers what CollManifestRead and CollMaterialise will actually produce.
+// They go in $TMPDIR if it's set, otherwise next to the outputs.
+static int verify_manifest(const char *manifest, const char *outdir, int n) {
+	struct CollManifest *m = CollManifestRead(manifest);
+	const char *dir = getenv("TMPDIR");
+	char *tmpdir = NULL, **paths = NULL;
+	int rc = -1, made = 0;
+
+	if(!m)
+		return fail("could not read back manifest %s", manifest);
+	if(m->nvariants != n) {
+		fail("manifest %s has %d variants, expected %d", manifest, m->nvariants, n);
+		goto done;
+	}
+	if(!dir || !*dir)
+		dir = outdir;
+	if(asprintf(&tmpdir, "%s/jpegcoll.XXXXXX", dir) < 0) {
+		tmpdir = NULL;
+		fail("out of memory");
+		goto done;
+	}
+	if(!mkdtemp(tmpdir)) {
+		fail("can't make a directory to verify in under %s: %s", dir, strerror(errno));
+		goto done;
+	}
+	made = 1;
+	if((paths = calloc(n, sizeof(*paths))) == NULL) {
+		fail("out of memory");
+		goto done;
+	}
+	for(int i = 0; i < n; i++) {
+		if(asprintf(&paths[i], "%s/%s", tmpdir, m->variants[i].name) < 0) {
+			paths[i] = NULL;
+			fail("out of memory");
+			goto done;
+		}
+		if(CollMaterialise(m, i, paths[i]) < 0) {
+			fail("could not materialise %s from %s: %s", m->variants[i].name, manifest, strerror(errno));
+			goto done;
+		}
+	}
+	rc = verify_outputs(paths, n);
+done:
+	for(int i = 0; paths && i < n; i++) {
+		if(paths[i])
+			unlink(paths[i]);
+		free(paths[i]);
+	}
+	if(made)
+		rmdir(tmpdir);
+	free(tmpdir);
+	free(paths);
+	CollManifestFree(m);
+	return rc;
+}
+
+static int write_outputs(const struct CollBuildOptions *opts, const char *outdir, const char *base,
+                         struct image *imgs, struct CollPatch *patches, int n) {
+	struct CollManifestVariant *variants = NULL;
+	char **paths = NULL;
+	int rc = -1;
+
+	if(opts->manifest) {
+		char name[PATH_MAX];
+		if((variants = calloc(n, sizeof(*variants))) == NULL)
+			return fail("out of memory");
+		for(int i = 0; i < n; i++) {
+			variants[i].name = imgs[i].name;
+			variants[i].npatches = i < n - 1;
+			variants[i].patches = &patches[i];
+		}
+		manifest_base(opts->manifest, base, name, sizeof(name));
+		if(CollManifestWrite(opts->manifest, name, variants, n) < 0)
+			rc = fail("could not write manifest %s: %s", opts->manifest, strerror(errno));
+		else
+			rc = opts->verify ? verify_manifest(opts->manifest, outdir, n) : 0;
+		free(variants);
+		return rc;
+	}
+
+	if((paths = calloc(n, sizeof(*paths))) == NULL)
+		return fail("out of memory");
+	for(int i = 0; i < n; i++) {
+		if(i == n - 1) {
+			paths[i] = strdup(base);
+		} else if(asprintf(&paths[i], "%s/%s", outdir, imgs[i].name) < 0) {
+			paths[i] = NULL;
+		}
+		if(!paths[i]) {
+			fail("out of memory");
+			goto done;
+		}
+		if(i < n - 1 && CollWriteVariant(base, paths[i], &patches[i], 1) < 0) {
+			fail("could not write %s: %s", paths[i], strerror(errno));
+			goto done;
+		}
+	}
+	rc = opts->verify ? verify_outputs(paths, n) : 0;
+done:
+	for(int i = 0; i < n; i++)
+		free(paths[i]);
+	free(paths);
+	return rc;
+}
+
+/* The base is written under a temporary name in outdir and renamed into
+ * place once it's complete: outdir may hold the inputs, and the last one
+ * is read after the base is started. Sets *tmp, which the caller frees. */
+static int create_temp(const char *outdir, const char *name, char **tmp) {
+	static unsigned int counter;
+	for(;;) {
+		unsigned int n = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+		int fd;
+		if(asprintf(tmp, "%s/.%s.%d.%u", outdir, name, (int)getpid(), n) < 0) {
+			*tmp = NULL;
+			errno = ENOMEM;
+			return -1;
+		}
+		if((fd = open(*tmp, O_WRONLY | O_CREAT | O_EXCL, 0666)) >= 0 || errno != EEXIST) {
+			if(fd < 0) {
+				int e = errno;
+				free(*tmp);
+				*tmp = NULL;
+				errno = e;
+			}
+			return fd;
+		}
+		free(*tmp);
+	}
+}
+
+int CollBuild(const struct CollBuildOptions *opts, const struct CollImage *images, int nimages, const char *outdir) {
+	struct image *imgs = NULL;
+	struct CollPatch *patches = NULL;
+	struct hashed_out out = { -1 };
+	struct CollBuildOptions hedged;
+	struct CollPool *own_pool = NULL;
+	char *base = NULL, *tmp = NULL;
+	uint64_t saved = 0;
+	int rc = -1, current = -1;
+
+	if(nimages < 2)
+		return fail("need at least two images");
+	if((opts->hedge > 1 || opts->cancel_fd >= 0) && !opts->pool) {
+		// racing variants and stopping a search halfway both need a pool;
+		// this build gets one of its own
+		if((own_pool = CollPoolCreate(opts->threads)) == NULL)
+			return fail("can't start search threads");
+		hedged = *opts;
+		hedged.pool = own_pool;
+		opts = &hedged;
+	}
+	if((imgs = calloc(nimages, sizeof(*imgs))) == NULL || (patches = calloc(nimages, sizeof(*patches))) == NULL) {
+		fail("out of memory");
+		goto done;
+	}
+	for(int i = 0; i < nimages; i++) {
+		if(check_image(&images[i], &imgs[i]) < 0)
+			goto done;
+	}
+
+	MD5Init(&out.ctx);
+	if(opts->prefix) {
+		memcpy(out.ctx.buf, opts->iv, sizeof(out.ctx.buf));
+		if(MD5PrefixContext(&out.ctx, opts->prefix, opts->position, opts->cache ? MD5_PREFIX_CACHE : 0) < 0) {
+			fail("could not hash %llu bytes of prefix %s", (unsigned long long)opts->position, opts->prefix);
+			goto done;
+		}
+	} else {
+		// the IV stands for position bytes we don't have, so they have to be whole blocks
+		if(opts->position % 64) {
+			fail("position must be a whole number of blocks without a prefix");
+			goto done;
+		}
+		memcpy(out.ctx.buf, opts->iv, sizeof(out.ctx.buf));
+		out.ctx.bits[0] = (uint32_t)(opts->position << 3);
+		out.ctx.bits[1] = (uint32_t)(opts->position >> 29);
+	}
+	// the stream from here on is the output itself
+	out.size = 0;
+
+	if(asprintf(&base, "%s/%s", outdir, imgs[nimages - 1].name) < 0) {
+		base = NULL;
+		fail("out of memory");
+		goto done;
+	}
+	if((out.fd = create_temp(outdir, imgs[nimages - 1].name, &tmp)) < 0) {
+		fail("can't create a file in %s: %s", outdir, strerror(errno));
+		goto done;
+	}
+	if(out_write(&out, "\xff\xd8", 2) < 0) {
+		fail("write failed: %s", strerror(errno));
+		goto done;
+	}
+	for(int i = 0; i < nimages - 1; i++) {
+		struct timespec start, end;
+		if(cancelled(opts)) {
+			fail("cancelled");
+			goto done;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		current = i;
+		prefetch_image(&imgs[i + 1]);
+		if(load_image(opts, &imgs[i], &saved) < 0 || append_image(opts, &out, &imgs[i], &patches[i]) < 0)
+			goto done;
+		close_image(&imgs[i]);
+		current = -1;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if(opts->times)
+			opts->times[i] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		if(opts->progress)
+			opts->progress(opts->progress_arg, i + 1, nimages - 1);
+	}
+	current = nimages - 1;
+	if(load_image(opts, &imgs[current], &saved) < 0)
+		goto done;
+	for(int s = 0; s < imgs[current].nspans; s++) {
+		if(out_write(&out, imgs[current].spans[s].data, imgs[current].spans[s].len) < 0) {
+			fail("write failed: %s", strerror(errno));
+			goto done;
+		}
+	}
+	close_image(&imgs[current]);
+	current = -1;
+	if(opts->saved)
+		*opts->saved = saved;
+	if(close(out.fd) < 0) {
+		out.fd = -1;
+		fail("write failed: %s", strerror(errno));
+		goto done;
+	}
+	out.fd = -1;
+	if(rename(tmp, base) < 0) {
+		fail("can't rename %s to %s: %s", tmp, base, strerror(errno));
+		goto done;
+	}
+	free(tmp);
+	tmp = NULL;
+
+	rc = write_outputs(opts, outdir, base, imgs, patches, nimages);
+done:
+	if(out.fd >= 0)
+		close(out.fd);
+	if(tmp) {
+		unlink(tmp);
+		free(tmp);
+	}
+	if(current >= 0)
+		close_image(&imgs[current]);
+	free(base);
+	free(imgs);
+	free(patches);
+	if(own_pool)
+		CollPoolDestroy(own_pool);
+	return rc;
+}
+
+struct CollBuildJob {
+	struct CollBuildOptions opts;
+	const struct CollImage *images;
+	int nimages;
+	const char *outdir;
+	int fd;			/* signalled when the build is over */
+	int cancel_fd;
+	int rc;
+	char error[sizeof(build_error)];
+	pthread_t thread;
+};
+
+static void *build_thread(void *arg) {
+	struct CollBuildJob *b = arg;
+	uint64_t one = 1;
+	b->rc = CollBuild(&b->opts, b->images, b->nimages, b->outdir);
+	if(b->rc < 0)
+		memcpy(b->error, build_error, sizeof(b->error));
+	while(write(b->fd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+	return NULL;
+}
+
+static void free_build_job(struct CollBuildJob *b) {
+	if(b->fd >= 0)
+		close(b->fd);
+	if(b->cancel_fd >= 0)
+		close(b->cancel_fd);
+	free(b);
+}
+
+struct CollBuildJob *CollBuildStart(const struct CollBuildOptions *opts, const struct CollImage *images, int nimages, const char *outdir) {
+	struct CollBuildJob *b = calloc(1, sizeof(*b));
+	if(!b) {
+		fail("out of memory");
+		return NULL;
+	}
+	b->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	b->cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(b->fd < 0 || b->cancel_fd < 0) {
+		fail("can't make an eventfd: %s", strerror(errno));
+		free_build_job(b);
+		return NULL;
+	}
+	b->opts = *opts;
+	b->opts.cancel_fd = b->cancel_fd;
+	b->images = images;
+	b->nimages = nimages;
+	b->outdir = outdir;
+	if(pthread_create(&b->thread, NULL, build_thread, b) != 0) {
+		fail("can't start the build thread");
+		free_build_job(b);
+		return NULL;
+	}
+	return b;
+}
+
+int CollBuildFd(struct CollBuildJob *b) {
+	return b->fd;
+}
+
+void CollBuildCancel(struct CollBuildJob *b) {
+	uint64_t one = 1;
+	while(write(b->cancel_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+}
+
+int CollBuildFinish(struct CollBuildJob *b) {
+	int rc;
+	pthread_join(b->thread, NULL);
+	rc = b->rc;
+	if(rc < 0)
+		fail("%s", b->error);
+	free_build_job(b);
+	return rc;
+}
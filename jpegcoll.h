@@ -0,0 +1,78 @@
+#ifndef JPEGCOLL_H
+#define JPEGCOLL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The whole multi-collision JPEG build in one call (jpegcoll.c): N images
+ * in, N outputs out that all share an MD5, each one showing a different
+ * image. The base output (named after the last image) is written once,
+ * hashed as it goes so every collision is searched from the running
+ * midstate, and the other outputs are clones of it with one collision
+ * block swapped (see output.h), or a patch manifest (see manifest.h). */
+
+struct CollPool;
+
+struct CollImage {
+	const char *path;		/* read (mapped) from here unless data is set */
+	const unsigned char *data;	/* or the whole file in memory */
+	size_t len;
+	const char *name;		/* output file name, default basename(path) */
+};
+
+struct CollBuildOptions {
+	uint32_t iv[4];		/* midstate before the output, if there's no prefix */
+	const char *prefix;	/* file whose first position bytes come before the output */
+	uint64_t position;	/* where the output will start */
+	const char *badchars;	/* 256-entry table of bytes the blocks can't contain, or NULL */
+	int cache;		/* use the prefix midstate and collision caches */
+	int threads;		/* per search when there's no pool, 0 = one per CPU */
+	struct CollPool *pool;	/* search on this pool (see pool.h) instead */
+	int priority;		/* of those searches */
+	int verify;		/* hash all the outputs at the end and compare; with a
+			 * manifest, read it back and materialise them from it
+			 * under $TMPDIR, or outdir if that isn't set */
+	const char *manifest;	/* write only the base and this manifest */
+	/* called after each collision, done of total */
+	void (*progress)(void *arg, int done, int total);
+	void *progress_arg;
+	/* race this many variants of each collision's alignment padding and
+	 * keep whichever finishes first (at most 16; 0 or 1 = off). They share
+	 * one search's worth of the pool's workers; without a pool the build
+	 * starts one of threads workers for them. */
+	int hedge;
+	int hedge_delay_ms;	/* start the extra variants only after this long */
+	double *times;		/* if set, seconds each collision took, nimages-1 of them */
+	/* drop the metadata before each image's first scan: 1 = every APPn
+	 * but JFIF, ICC profiles and Adobe, and every comment (EXIF goes, and
+	 * its orientation with it); 2 = the ICC profiles too */
+	int slim;
+	uint64_t *saved;	/* if set, gets the bytes slimming took out */
+	/* give up, failing with "cancelled", once this fd is readable (-1 =
+	 * never). Without a pool the build starts one of threads workers,
+	 * so a search can be stopped halfway. */
+	int cancel_fd;
+};
+
+/* Standard IV, caches on, no cancel_fd, everything else off */
+extern void CollBuildDefaults(struct CollBuildOptions *opts);
+/* Returns 0 on success, -1 with a message for CollBuildError. */
+extern int CollBuild(const struct CollBuildOptions *opts, const struct CollImage *images, int nimages, const char *outdir);
+/* Why the last CollBuild on this thread failed */
+extern const char *CollBuildError(void);
+
+/* The same build on a thread of its own, for callers that have to stay
+ * responsive (to signals, or to a client going away). opts is copied, but
+ * the images and the strings everything points to must last until
+ * CollBuildFinish. CollBuildFd becomes readable when the build is over;
+ * CollBuildCancel stops it at the next collision search or between
+ * collisions (it uses opts->cancel_fd for that). CollBuildFinish waits for
+ * it, frees the handle and returns CollBuild's result, with the error for
+ * CollBuildError on the calling thread. Start returns NULL on failure. */
+struct CollBuildJob;
+extern struct CollBuildJob *CollBuildStart(const struct CollBuildOptions *opts, const struct CollImage *images, int nimages, const char *outdir);
+extern int CollBuildFd(struct CollBuildJob *b);
+extern void CollBuildCancel(struct CollBuildJob *b);
+extern int CollBuildFinish(struct CollBuildJob *b);
+
+#endif /* !JPEGCOLL_H */
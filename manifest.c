@@ -0,0 +1,237 @@
+/* Patch manifests, see manifest.h */
+#define _GNU_SOURCE
+#include "manifest.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#define MANIFEST_MAGIC "CJPM"
+#define MANIFEST_VERSION 1
+#define MAX_NAME 0xffff		/* names are stored with a 16-bit length */
+
+static void put_le(FILE *f, uint64_t v, int bytes) {
+	for(int i = 0; i < bytes; i++)
+		fputc((v >> (8*i)) & 0xff, f);
+}
+
+static int get_le(FILE *f, uint64_t *v, int bytes) {
+	*v = 0;
+	for(int i = 0; i < bytes; i++) {
+		int c = fgetc(f);
+		if(c == EOF)
+			return -1;
+		*v |= (uint64_t)c << (8*i);
+	}
+	return 0;
+}
+
+static char *get_string(FILE *f) {
+	uint64_t len;
+	char *s;
+
+	if(get_le(f, &len, 2) < 0 || (s = malloc(len + 1)) == NULL)
+		return NULL;
+	if(fread(s, 1, len, f) != len || memchr(s, '\0', len) != NULL) {
+		free(s);
+		return NULL;
+	}
+	s[len] = '\0';
+	return s;
+}
+
+int CollManifestWrite(const char *path, const char *base, const struct CollManifestVariant *variants, int nvariants) {
+	FILE *f;
+
+	// checked before anything is written, so a bad name can't leave a
+	// manifest that won't read back
+	for(int i = -1; i < nvariants; i++) {
+		if(strlen(i < 0 ? base : variants[i].name) > MAX_NAME) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+	}
+	if((f = fopen(path, "wb")) == NULL)
+		return -1;
+	fwrite(MANIFEST_MAGIC, 1, 4, f);
+	put_le(f, MANIFEST_VERSION, 4);
+	put_le(f, strlen(base), 2);
+	fputs(base, f);
+	put_le(f, nvariants, 4);
+	for(int i = 0; i < nvariants; i++) {
+		put_le(f, strlen(variants[i].name), 2);
+		fputs(variants[i].name, f);
+		put_le(f, variants[i].npatches, 4);
+		for(int j = 0; j < variants[i].npatches; j++) {
+			put_le(f, variants[i].patches[j].position, 8);
+			fwrite(variants[i].patches[j].block, 1, 128, f);
+		}
+	}
+	if(ferror(f)) {
+		fclose(f);
+		return -1;
+	}
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+static char *resolve_base(const char *manifest, char *base) {
+	const char *slash = strrchr(manifest, '/');
+	char *path;
+
+	if(base[0] == '/' || slash == NULL)
+		return base;
+	if((path = malloc((slash - manifest) + 1 + strlen(base) + 1)) != NULL)
+		sprintf(path, "%.*s/%s", (int)(slash - manifest), manifest, base);
+	free(base);
+	return path;
+}
+
+struct CollManifest *CollManifestRead(const char *path) {
+	FILE *f = fopen(path, "rb");
+	struct CollManifest *m;
+	char magic[4];
+	uint64_t v;
+
+	if(f == NULL)
+		return NULL;
+	if((m = calloc(1, sizeof(*m))) == NULL)
+		goto fail;
+	if(fread(magic, 1, 4, f) != 4 || memcmp(magic, MANIFEST_MAGIC, 4) != 0 ||
+	   get_le(f, &v, 4) < 0 || v != MANIFEST_VERSION)
+		goto fail;
+	if((m->base = get_string(f)) == NULL || (m->base = resolve_base(path, m->base)) == NULL)
+		goto fail;
+	if(get_le(f, &v, 4) < 0 || v > 1 << 24 ||
+	   (m->variants = calloc(v ? v : 1, sizeof(*m->variants))) == NULL)
+		goto fail;
+	m->nvariants = v;
+	for(int i = 0; i < m->nvariants; i++) {
+		struct CollManifestVariant *var = &m->variants[i];
+		if((var->name = get_string(f)) == NULL || get_le(f, &v, 4) < 0 || v > 1 << 24 ||
+		   (var->patches = calloc(v ? v : 1, sizeof(*var->patches))) == NULL)
+			goto fail;
+		var->npatches = v;
+		for(int j = 0; j < var->npatches; j++) {
+			if(get_le(f, &var->patches[j].position, 8) < 0 ||
+			   fread(var->patches[j].block, 1, 128, f) != 128)
+				goto fail;
+		}
+	}
+	fclose(f);
+	return m;
+
+fail:
+	fclose(f);
+	CollManifestFree(m);
+	return NULL;
+}
+
+void CollManifestFree(struct CollManifest *m) {
+	if(m == NULL)
+		return;
+	for(int i = 0; i < m->nvariants; i++) {
+		free(m->variants[i].name);
+		free(m->variants[i].patches);
+	}
+	free(m->variants);
+	free(m->base);
+	free(m);
+}
+
+int CollManifestFind(const struct CollManifest *m, const char *name) {
+	for(int i = 0; i < m->nvariants; i++)
+		if(strcmp(m->variants[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+int CollMaterialise(const struct CollManifest *m, int variant, const char *path) {
+	if(variant < 0 || variant >= m->nvariants)
+		return -1;
+	return CollWriteVariant(m->base, path, m->variants[variant].patches, m->variants[variant].npatches);
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	while(len > 0) {
+		ssize_t r = write(fd, p, len);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+// copy [off, end) of the base to fd
+static int stream_range(int in, int fd, off_t off, off_t end) {
+	char buf[1 << 16];
+
+#ifdef __linux__
+	while(off < end) {
+		ssize_t r = sendfile(fd, in, &off, end - off);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			break;
+	}
+#endif
+	while(off < end) {
+		size_t want = end - off < (off_t)sizeof(buf) ? end - off : sizeof(buf);
+		ssize_t r = pread(in, buf, want, off);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0 || write_full(fd, buf, r) < 0)
+			return -1;
+		off += r;
+	}
+	return 0;
+}
+
+static int patch_cmp(const void *a, const void *b) {
+	const struct CollPatch *pa = *(const struct CollPatch *const *)a, *pb = *(const struct CollPatch *const *)b;
+	return pa->position < pb->position ? -1 : pa->position > pb->position;
+}
+
+int CollMaterialiseFd(const struct CollManifest *m, int variant, int fd) {
+	const struct CollManifestVariant *var;
+	const struct CollPatch **sorted;
+	struct stat st;
+	off_t off = 0;
+	int in, r = -1;
+
+	if(variant < 0 || variant >= m->nvariants)
+		return -1;
+	var = &m->variants[variant];
+	if((in = open(m->base, O_RDONLY)) < 0)
+		return -1;
+	if(fstat(in, &st) < 0 || (sorted = malloc((var->npatches + 1) * sizeof(*sorted))) == NULL) {
+		close(in);
+		return -1;
+	}
+	for(int i = 0; i < var->npatches; i++)
+		sorted[i] = &var->patches[i];
+	qsort(sorted, var->npatches, sizeof(*sorted), patch_cmp);
+
+	for(int i = 0; i < var->npatches; i++) {
+		const struct CollPatch *p = sorted[i];
+		if(p->position < (uint64_t)off || p->position + 128 > (uint64_t)st.st_size)
+			goto out;
+		if(stream_range(in, fd, off, p->position) < 0 || write_full(fd, p->block, 128) < 0)
+			goto out;
+		off = p->position + 128;
+	}
+	r = stream_range(in, fd, off, st.st_size);
+out:
+	free(sorted);
+	close(in);
+	return r;
+}
@@ -0,0 +1,45 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "output.h"
+
+/* Patch manifests: instead of N complete outputs a run can leave one base
+ * file plus a manifest listing, for each variant, the blocks that differ
+ * from the base. Any variant can then be materialised on demand, either as
+ * a file (cloned and patched like any other output) or streamed to a file
+ * descriptor.
+ *
+ * On disk, all integers little-endian:
+ *   "CJPM" u32 version (1)
+ *   u16 length, base file name (relative names are relative to the manifest)
+ *   u32 variant count, then per variant:
+ *     u16 length, variant name
+ *     u32 patch count, then per patch: u64 position, 128 bytes of block
+ */
+
+struct CollManifestVariant {
+	char *name;
+	int npatches;
+	struct CollPatch *patches;
+};
+
+struct CollManifest {
+	char *base;     // resolved against the manifest's directory
+	int nvariants;
+	struct CollManifestVariant *variants;
+};
+
+/* Returns 0 on success, -1 on error (ENAMETOOLONG, writing nothing, if the
+ * base or a variant name is longer than 65535 bytes) */
+extern int CollManifestWrite(const char *path, const char *base, const struct CollManifestVariant *variants, int nvariants);
+/* Returns NULL on error */
+extern struct CollManifest *CollManifestRead(const char *path);
+extern void CollManifestFree(struct CollManifest *m);
+/* Index of the variant with this name, or -1 */
+extern int CollManifestFind(const struct CollManifest *m, const char *name);
+
+/* Write variant to path, or stream it to fd. Return 0 on success. */
+extern int CollMaterialise(const struct CollManifest *m, int variant, const char *path);
+extern int CollMaterialiseFd(const struct CollManifest *m, int variant, int fd);
+
+#endif /* !MANIFEST_H */
@@ -21,6 +21,7 @@
 
 #include "md5.h"
 #include <memory.h>		 /* for memcpy() */
+#include <stdint.h>		 /* for uintptr_t */
 
 #ifndef HIGHFIRST
 #define byteReverse(buf, len)	/* Nothing */
@@ -59,7 +60,7 @@ void MD5Init(struct MD5Context *ctx)
  * Update context to reflect the concatenation of another buffer full
  * of bytes.
  */
-void MD5Update(struct MD5Context *ctx, unsigned char *buf, unsigned len)
+void MD5Update(struct MD5Context *ctx, unsigned char *buf, size_t len)
 {
     uint32_t t;
 
@@ -68,7 +69,7 @@ void MD5Update(struct MD5Context *ctx, unsigned char *buf, unsigned len)
     t = ctx->bits[0];
     if ((ctx->bits[0] = t + ((uint32_t) len << 3)) < t)
 	ctx->bits[1]++; 	/* Carry from low to high */
-    ctx->bits[1] += len >> 29;
+    ctx->bits[1] += (uint32_t) (len >> 29);
 
     t = (t >> 3) & 0x3f;	/* Bytes already in shsInfo->data */
 
@@ -88,14 +89,12 @@ void MD5Update(struct MD5Context *ctx, unsigned char *buf, unsigned len)
 	buf += t;
 	len -= t;
     }
-    /* Process data in 64-byte chunks */
+    /* Process data in 64-byte chunks, straight from the caller's buffer */
 
-    while (len >= 64) {
-	memcpy(ctx->in, buf, 64);
-	byteReverse(ctx->in, 16);
-	MD5Transform(ctx->buf, (uint32_t *) ctx->in);
-	buf += 64;
-	len -= 64;
+    if (len >= 64) {
+	MD5TransformBlocks(ctx->buf, buf, len / 64);
+	buf += len & ~(size_t) 63;
+	len &= 63;
     }
 
     /* Handle any remaining bytes of data. */
@@ -154,19 +153,37 @@ void MD5Final(unsigned char digest[16], struct MD5Context *ctx)
 /* #define F1(x, y, z) (x & y | ~x & z) */
 #define F1(x, y, z) (z ^ (x & (y ^ z)))
 #define F2(x, y, z) F1(z, x, y)
-#define F3(x, y, z) (x ^ y ^ z)
+#define F3(x, y, z) (x ^ (y ^ z))
 #define F4(x, y, z) (y ^ (x | ~z))
 
-/* This is the central step in the MD5 algorithm. */
+/*
+ * This is the central step in the MD5 algorithm.  x is the value the
+ * previous step has only just produced, so the data word is added to w
+ * first and each function touches x as late as it can; that keeps the
+ * serial dependency chain to the function, one add, the rotate and the
+ * final add.
+ */
 #define MD5STEP(f, w, x, y, z, data, s) \
-	( w += f(x, y, z) + data,  w = w<<s | w>>(32-s),  w += x )
+	( w += data,  w += f(x, y, z),  w = w<<s | w>>(32-s),  w += x )
+
+/*
+ * Round 2 uses F2(x, y, z) = (x & z) | (y & ~z).  The two halves never
+ * share a bit, so they can be added separately, and y & ~z doesn't wait
+ * for x at all.
+ */
+#define MD5STEP2(w, x, y, z, data, s) \
+	( w += data + (y & ~z),  w += x & z,  w = w<<s | w>>(32-s),  w += x )
+
+#ifdef MD5_ASM
+extern void md5_transform_blocks_x86_64(uint32_t buf[4], const unsigned char *data, size_t nblocks);
+#endif
 
 /*
  * The core of the MD5 algorithm, this alters an existing MD5 hash to
  * reflect the addition of 16 longwords of new data.  MD5Update blocks
  * the data and converts bytes into longwords for this routine.
  */
-void MD5Transform(uint32_t buf[4], uint32_t in[16])
+static inline void md5_transform(uint32_t buf[4], const uint32_t in[16])
 {
     register uint32_t a, b, c, d;
 
@@ -192,22 +209,22 @@ void MD5Transform(uint32_t buf[4], uint32_t in[16])
     MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
     MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
 
-    MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
-    MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
-    MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-    MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
-    MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
-    MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
-    MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-    MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
-    MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
-    MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
-    MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
-    MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
-    MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
-    MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
-    MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
-    MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+    MD5STEP2(a, b, c, d, in[1] + 0xf61e2562, 5);
+    MD5STEP2(d, a, b, c, in[6] + 0xc040b340, 9);
+    MD5STEP2(c, d, a, b, in[11] + 0x265e5a51, 14);
+    MD5STEP2(b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+    MD5STEP2(a, b, c, d, in[5] + 0xd62f105d, 5);
+    MD5STEP2(d, a, b, c, in[10] + 0x02441453, 9);
+    MD5STEP2(c, d, a, b, in[15] + 0xd8a1e681, 14);
+    MD5STEP2(b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+    MD5STEP2(a, b, c, d, in[9] + 0x21e1cde6, 5);
+    MD5STEP2(d, a, b, c, in[14] + 0xc33707d6, 9);
+    MD5STEP2(c, d, a, b, in[3] + 0xf4d50d87, 14);
+    MD5STEP2(b, c, d, a, in[8] + 0x455a14ed, 20);
+    MD5STEP2(a, b, c, d, in[13] + 0xa9e3e905, 5);
+    MD5STEP2(d, a, b, c, in[2] + 0xfcefa3f8, 9);
+    MD5STEP2(c, d, a, b, in[7] + 0x676f02d9, 14);
+    MD5STEP2(b, c, d, a, in[12] + 0x8d2a4c8a, 20);
 
     MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
     MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
@@ -248,3 +265,38 @@ void MD5Transform(uint32_t buf[4], uint32_t in[16])
     buf[2] += c;
     buf[3] += d;
 }
+
+void MD5Transform(uint32_t buf[4], uint32_t in[16])
+{
+#ifdef MD5_ASM
+    md5_transform_blocks_x86_64(buf, (const unsigned char *) in, 1);
+#else
+    md5_transform(buf, in);
+#endif
+}
+
+/*
+ * Run MD5Transform over nblocks consecutive 64-byte blocks.  When the
+ * bytes are already in the right order and suitably aligned they are
+ * used where they lie; otherwise each block goes through a local copy.
+ */
+void MD5TransformBlocks(uint32_t buf[4], const unsigned char *data, size_t nblocks)
+{
+#ifdef MD5_ASM
+    md5_transform_blocks_x86_64(buf, data, nblocks);
+#else
+    uint32_t in[16];
+
+    for (; nblocks > 0; nblocks--, data += 64) {
+#ifndef HIGHFIRST
+	if (((uintptr_t) data & 3) == 0) {
+	    md5_transform(buf, (const uint32_t *) data);
+	    continue;
+	}
+#endif
+	memcpy(in, data, 64);
+	byteReverse((unsigned char *) in, 16);
+	md5_transform(buf, in);
+    }
+#endif
+}
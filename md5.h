@@ -2,6 +2,7 @@
 #define MD5_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /*  The following tests optimise behaviour on little-endian
     machines, where there is no need to reverse the byte order
@@ -31,12 +32,56 @@ struct MD5Context {
 };
 
 extern void MD5Init(struct MD5Context *ctx);
-extern void MD5Update(struct MD5Context *ctx, unsigned char *buf, unsigned len);
+extern void MD5Update(struct MD5Context *ctx, unsigned char *buf, size_t len);
 extern void MD5Final(unsigned char digest[16], struct MD5Context *ctx);
 extern void MD5Transform(uint32_t buf[4], uint32_t in[16]);
+extern void MD5TransformBlocks(uint32_t buf[4], const unsigned char *data, size_t nblocks);
 
 extern void MD5CollideBlock0(uint32_t iv[4], uint32_t block[16], const char *badchars);
 extern void MD5CollideBlock1(uint32_t iv[4], uint32_t block[16], const char *badchars);
+/* As above with an explicit RNG seed; give up and return 0 once *stop is
+ * set (stop may be NULL), return 1 with a block otherwise. */
+extern int MD5CollideBlock0Ex(uint32_t iv[4], uint32_t block[16], const char *badchars, uint64_t seed, volatile int *stop);
+extern int MD5CollideBlock1Ex(uint32_t iv[4], uint32_t block[16], const char *badchars, uint64_t seed, volatile int *stop);
+/* Both blocks of a collision for iv, raced over nthreads threads (0 = one
+ * per CPU) with different seeds. blocks gets block 0 then block 1 of the
+ * first message. With MD5_COLLISION_CACHE a collision found before for the
+ * same IV and constraints is reused, and a new one is remembered (see
+ * cache.h). Returns 0 on success. */
+#define MD5_COLLISION_CACHE 1
+extern int MD5FindCollision(const uint32_t iv[4], uint32_t blocks[32], const char *badchars, int nthreads, int flags);
+/* The cache on its own: load returns 1 and fills blocks with a verified
+ * collision on a hit, 0 otherwise. */
+extern int MD5CollisionCacheLoad(const uint32_t iv[4], const char *badchars, uint32_t blocks[32]);
+extern void MD5CollisionCacheStore(const uint32_t iv[4], const char *badchars, const uint32_t blocks[32]);
+/* The two 128-byte messages of a collision: blocks as they come from
+ * MD5FindCollision, and the same with the fastcoll differences added. */
+extern void MD5CollisionMessages(const uint32_t blocks[32], unsigned char a[128], unsigned char b[128]);
+/* A fresh seed for the Ex searches */
+extern uint64_t MD5SearchSeed(void);
+/* Returns 1 if the two distinct 128-byte messages end in the same chaining
+ * value when hashed from iv. */
+extern int MD5VerifyCollision(const uint32_t iv[4], const unsigned char blocka[128], const unsigned char blockb[128]);
+
+/* Hash the first len bytes of a file into ctx, which must hold the starting
+ * IV and a zero bit count. Whole blocks go straight from the mapping to
+ * MD5Transform; the trailing partial block is left in ctx->in, so the caller
+ * can carry on with MD5Update. With MD5_PREFIX_CACHE the midstate is looked
+ * up in and saved to the on-disk cache (see cache.h). Returns 0 on success. */
+#define MD5_PREFIX_CACHE 1
+extern int MD5PrefixContext(struct MD5Context *ctx, const char *path, uint64_t len, int flags);
+/* Digest whole files, spread over nthreads threads (0 = one per CPU), each
+ * hashing a lane-width of files at a time with MD5MultiBuffer. digests
+ * receives 16 bytes per path. Returns 0 if every file was read. */
+extern int MD5HashFiles(const char *const *paths, int n, unsigned char *digests, int nthreads);
+
+/* Multi-buffer MD5 (md5mb.c): 4, 8 or 16 independent streams per call, one
+ * per SIMD lane. state holds 4*lanes words, word-major (state[w*lanes + l]),
+ * and blocks[l] points at the next 64 bytes of stream l. */
+extern int MD5MultiBufferLanes(void);
+extern void MD5TransformMB(int lanes, uint32_t *state, const unsigned char *const *blocks);
+/* Complete digests of n buffers of any lengths, 16 bytes each into digests */
+extern void MD5MultiBuffer(const unsigned char *const *bufs, const size_t *lens, int n, unsigned char *digests);
 
 /*
  * This is needed to make RSAREF happy on some MS-DOS compilers.
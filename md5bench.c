@@ -0,0 +1,197 @@
+/* md5bench: MD5 throughput, current code against the original 1993
+ * MD5Transform/MD5Update (kept here verbatim apart from names) and against
+ * the multi-buffer engine. Fails if the aligned or unaligned MD5Update
+ * state differs from the reference, or any multi-buffer lane's digest from
+ * MD5Update/MD5Final over the same bytes.
+ *
+ *   md5bench [megabytes]
+ */
+#include "md5.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+#define MD5STEP(f, w, x, y, z, data, s) \
+	( w += f(x, y, z) + data,  w = w<<s | w>>(32-s),  w += x )
+
+static void ref_transform(uint32_t buf[4], uint32_t in[16]) {
+	register uint32_t a, b, c, d;
+
+	a = buf[0];
+	b = buf[1];
+	c = buf[2];
+	d = buf[3];
+
+	MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
+	MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
+	MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
+	MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
+	MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
+	MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
+	MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
+	MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
+	MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
+	MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+	MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
+	MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+	MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+	MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+	MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+	MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
+	MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
+	MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
+	MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
+	MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+	MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
+	MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+	MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
+	MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
+	MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
+	MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
+	MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
+	MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
+	MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+	MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
+
+	MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
+	MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+	MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
+	MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+	MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
+	MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+	MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+	MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+	MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
+	MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+// the old MD5Update loop: every block is copied through ctx->in
+static void ref_update(struct MD5Context *ctx, unsigned char *buf, size_t len) {
+	while(len >= 64) {
+		memcpy(ctx->in, buf, 64);
+		ref_transform(ctx->buf, (uint32_t *)ctx->in);
+		buf += 64;
+		len -= 64;
+	}
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t bytes, double secs, double base) {
+	printf("%-28s %9.1f MB/s", name, bytes / secs / 1e6);
+	if(base > 0)
+		printf("  (%.2fx)", base / secs);
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	size_t mb = argc > 1 ? strtoul(argv[1], NULL, 0) : 256;
+	size_t len = mb << 20;
+	unsigned char *data = malloc(len + 64);
+	struct MD5Context ref, cur, cur_unaligned;
+	const unsigned char *bufs[16];
+	size_t lens[16], total = 0;
+	unsigned char digests[16*16], digest[16];
+	double t, base;
+	int lanes = MD5MultiBufferLanes();
+
+	if(data == NULL || len == 0) {
+		fprintf(stderr, "Usage: md5bench [megabytes]\n");
+		return 1;
+	}
+	for(size_t i = 0; i < len + 64; i++)
+		data[i] = i * 2654435761U >> 13;
+
+	MD5Init(&ref);
+	t = now();
+	ref_update(&ref, data, len);
+	base = now() - t;
+	report("1993 MD5Update", len, base, 0);
+
+	MD5Init(&cur);
+	t = now();
+	MD5Update(&cur, data, len);
+	report("MD5Update aligned", len, now() - t, base);
+
+	MD5Init(&cur_unaligned);
+	t = now();
+	MD5Update(&cur_unaligned, data + 1, len);
+	report("MD5Update unaligned", len, now() - t, base);
+
+	if(memcmp(ref.buf, cur.buf, sizeof(ref.buf)) != 0) {
+		fprintf(stderr, "md5bench: aligned results differ from the reference!\n");
+		return 1;
+	}
+	MD5Init(&ref);
+	ref_update(&ref, data + 1, len);
+	if(memcmp(ref.buf, cur_unaligned.buf, sizeof(ref.buf)) != 0) {
+		fprintf(stderr, "md5bench: unaligned results differ from the reference!\n");
+		return 1;
+	}
+
+	// every lane different, in where it starts and how much padding it ends with
+	for(int l = 0; l < lanes; l++) {
+		bufs[l] = data + l;
+		lens[l] = len / lanes - l;
+		total += lens[l];
+	}
+	t = now();
+	MD5MultiBuffer(bufs, lens, lanes, digests);
+	char name[32];
+	snprintf(name, sizeof(name), "MD5MultiBuffer x%d", lanes);
+	report(name, total, now() - t, base);
+
+	for(int l = 0; l < lanes; l++) {
+		MD5Init(&cur);
+		MD5Update(&cur, (unsigned char *)bufs[l], lens[l]);
+		MD5Final(digest, &cur);
+		if(memcmp(digest, digests + 16*l, 16) != 0) {
+			fprintf(stderr, "md5bench: MD5MultiBuffer lane %d differs from MD5Update!\n", l);
+			return 1;
+		}
+	}
+
+	free(data);
+	return 0;
+}
@@ -27,6 +27,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include "md5.h"
+#include "md5prof.h"
 #include <time.h>
 #include <assert.h>
 #include <stdio.h>
@@ -237,19 +238,25 @@ static inline double timediff(struct timespec start, struct timespec end) {
 }
 
 void MD5CollideBlock0(uint32_t iv[4], uint32_t block[16], const char *badchars) {
-	uint64_t rs = time(NULL) ^ 0xfeedface;
+	MD5CollideBlock0Ex(iv, block, badchars, time(NULL) ^ 0xfeedface, NULL);
+}
+
+// seed picks the search's starting point, so concurrent searches need
+// different ones; returns 0 without a block if *stop becomes set
+int MD5CollideBlock0Ex(uint32_t iv[4], uint32_t block[16], const char *badchars, uint64_t seed, volatile int *stop) {
+	uint64_t rs = seed | 1;
 	rs = xorshift64star(&rs);
 	uint32_t QandIV[28] = { iv[0], iv[3], iv[2], iv[1] };
 	uint32_t *Q = QandIV+3;
 	int success;
 	uint32_t t;
 
-#ifdef PROFILING
-	struct timespec start, startinner, end;
-	double overalltime = 0.0, innertime = 0.0;
-	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
-#endif
 	while(1) {
+		if(stop && *stop) {
+			PROF_STAGE(0, PROF_NONE);
+			return 0;
+		}
+		PROF_STAGE(0, PROF_STAGE1);
 		for(int i = 1; i < 17; i++) {
 			Q[i] = ((getrand32(&rs) & qconds[i].mask) | (Q[i-1] & qconds[i].pmask)) ^ qconds[i].inv;
 		}
@@ -309,6 +316,7 @@ void MD5CollideBlock0(uint32_t iv[4], uint32_t block[16], const char *badchars)
 			break;
 		}
 		if(!success) continue;
+		PROF_STAGE(0, PROF_TUNNELS);
 
 		// Don't use Q[4] -> block[5] tunnel to fix Q[21] as probably
 		// wouldn't work - we'd do:
@@ -353,6 +361,10 @@ void MD5CollideBlock0(uint32_t iv[4], uint32_t block[16], const char *badchars)
 			// use 4-bit Q[4] -> block[4] tunnel with cond Q[5]=0 && Q[6]=1
 			// changes block[3,4,7] (not 5,6 due to tunnel - protects Q[..23])
 			for(int q4ctr = 0; q4ctr < 16; q4ctr++) {
+				if(stop && *stop) {
+					PROF_STAGE(0, PROF_NONE);
+					return 0;
+				}
 				Q[4] = (Q[4] & ~0x38000004) | (((q4ctr<<2)|(q4ctr<<26)) & 0x38000004);
 
 				block[3] = MD5UNSTEP(Q, 3, 0xc1bdceee, 22);
@@ -374,9 +386,7 @@ void MD5CollideBlock0(uint32_t iv[4], uint32_t block[16], const char *badchars)
 #endif
 
 	 
-#ifdef PROFILING
-				clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &startinner);
-#endif
+				PROF_STAGE(0, PROF_INNER);
 				// use 16-bit Q[9] -> m[9] tunnel with cond Q[10]=0 && Q[11]=1
 				// affects block[8, 9, 12], preserves block[10,11]
 				// we seem to spend about 99.9% of our time in this inner loop
@@ -488,19 +498,13 @@ void MD5CollideBlock0(uint32_t iv[4], uint32_t block[16], const char *badchars)
 					assert(iv[0]+a == iv1[0] && iv[1]+b == iv1[1]  && iv[2]+c == iv1[2] && iv[3]+d == iv1[3]);
 					if(iv2[0] == iv1[0] + 0x80000000 && iv2[1] == iv1[1] + 0x82000000 &&
 					   iv2[2] == iv1[2] + 0x82000000 && iv2[3] == iv1[3] + 0x82000000) {
-#ifdef PROFILING
-						clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
-						overalltime = timediff(start, end);
-						innertime += timediff(startinner, end);
-						printf("\ninner: %f total: %f\n", innertime, overalltime);
-#endif
-						return;
+						PROF_CANDIDATES(0, q9ctr + 1);
+						PROF_STAGE(0, PROF_NONE);
+						return 1;
 					}
 				}
-#ifdef PROFILING
-				clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
-				innertime += timediff(startinner, end);
-#endif
+				PROF_CANDIDATES(0, 1 << 16);
+				PROF_STAGE(0, PROF_TUNNELS);
 			}
 		}
 	}
@@ -509,7 +513,11 @@ void MD5CollideBlock0(uint32_t iv[4], uint32_t block[16], const char *badchars)
 // WARNING: some of the blocks are constrained enough that using badchars
 // may potentially hang forever. You have been warned
 void MD5CollideBlock1(uint32_t iv[4], uint32_t block[16], const char *badchars) {
-	uint64_t rs = time(NULL) ^ 0xdeadf00d;
+	MD5CollideBlock1Ex(iv, block, badchars, time(NULL) ^ 0xdeadf00d, NULL);
+}
+
+int MD5CollideBlock1Ex(uint32_t iv[4], uint32_t block[16], const char *badchars, uint64_t seed, volatile int *stop) {
+	uint64_t rs = seed | 1;
 	rs = xorshift64star(&rs);
 	uint32_t QandIV[25] = { iv[0], iv[3], iv[2], iv[1] };
 	uint32_t *Q = QandIV+3;
@@ -517,6 +525,7 @@ void MD5CollideBlock1(uint32_t iv[4], uint32_t block[16], const char *badchars)
 	uint32_t q9m9bits[1<<9], q9q10bits[1<<6];
 	int path = (iv[1]&1) | ((iv[1] >> 5) & 2);
 	const struct qcond *qc = qconds2[path];
+	PROF_STAGE(1, PROF_STAGE1);
 	printf("(%i%i)", path>>1, path&1); fflush(stdout);
 	// precompute this as it's in the inner loop and too complicated
 	// if we didn't have to handle multiple paths with different tunnels
@@ -553,6 +562,11 @@ void MD5CollideBlock1(uint32_t iv[4], uint32_t block[16], const char *badchars)
 	//printf("DEBUG: num q9q10=%i\n", numq9q10);
 	
 	while(1) {
+		if(stop && *stop) {
+			PROF_STAGE(1, PROF_NONE);
+			return 0;
+		}
+		PROF_STAGE(1, PROF_STAGE1);
 		// obnoxious special-case hack since we don't have Q[1] at this point
 		Q[2] = ((getrand32(&rs) & qc[2].mask) | (Q[0] & qc[2].pmask)) ^ qc[2].inv;
 		for(int i = 3; i < 17; i++) {
@@ -616,7 +630,7 @@ void MD5CollideBlock1(uint32_t iv[4], uint32_t block[16], const char *badchars)
 
 		if(!success)
 			continue;
-
+		PROF_STAGE(1, PROF_TUNNELS);
 
 		uint32_t q9base = Q[9];
 		assert((q9base&q9m9masks[path]) == 0);
@@ -626,6 +640,10 @@ void MD5CollideBlock1(uint32_t iv[4], uint32_t block[16], const char *badchars)
 		assert((q10base&q9q10masks[path]&Q10MASK) == 0);
 		for(int q10ctr = 0; q10ctr < numq9q10; q10ctr++) {
 			uint32_t a2, b2, c2, d2;
+			if(stop && *stop) {
+				PROF_STAGE(1, PROF_NONE);
+				return 0;
+			}
 			uint32_t q9save = Q[9] = q9base | (q9q10bits[q10ctr]&~Q10MASK);
 			Q[10] = q10base | (q9q10bits[q10ctr]&Q10MASK);
 
@@ -649,6 +667,7 @@ void MD5CollideBlock1(uint32_t iv[4], uint32_t block[16], const char *badchars)
 			block[13] = MD5UNSTEP(Q, 13, 0xfd987193, 12);
 			if(HAS_BAD_CHARS(block[13])) continue;
 
+			PROF_STAGE(1, PROF_INNER);
 			for(int q9ctr = 0; q9ctr < (1<<9); q9ctr++) {
 				uint32_t a = a2, b = b2, c = c2, d = d2;
 				Q[9] = q9save | q9m9bits[q9ctr];
@@ -740,14 +759,44 @@ void MD5CollideBlock1(uint32_t iv[4], uint32_t block[16], const char *badchars)
 				MD5Transform(iv1, block);
 				MD5Transform(iv2, block2);
 				assert(iv[0] + a == iv1[0] && iv[1] +b == iv1[1]  && iv[2]+c == iv1[2] && iv[3]+d == iv1[3]);
-				if(iv2[0] == iv1[0] && iv2[1] == iv1[1] && iv2[2] == iv1[2] && iv2[3] == iv1[3])
-					return;
+				if(iv2[0] == iv1[0] && iv2[1] == iv1[1] && iv2[2] == iv1[2] && iv2[3] == iv1[3]) {
+					PROF_CANDIDATES(1, q9ctr + 1);
+					PROF_STAGE(1, PROF_NONE);
+					return 1;
+				}
 			}
+			PROF_CANDIDATES(1, 1 << 9);
+			PROF_STAGE(1, PROF_TUNNELS);
 			
 		}
 	}
 }
 
+static void load_words(uint32_t w[16], const unsigned char *p) {
+	for(int i = 0; i < 16; i++, p += 4)
+		w[i] = (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+// Check a candidate pair of two-block messages starting from chaining
+// value iv. Anything appended afterwards is identical in both files, so
+// equal chaining values here means equal final digests and there's no need
+// to rehash whatever came before.
+int MD5VerifyCollision(const uint32_t iv[4], const unsigned char blocka[128], const unsigned char blockb[128]) {
+	uint32_t iva[4], ivb[4], in[16];
+
+	if(memcmp(blocka, blockb, 128) == 0)
+		return 0;
+	memcpy(iva, iv, sizeof(iva));
+	memcpy(ivb, iv, sizeof(ivb));
+	for(int i = 0; i < 128; i += 64) {
+		load_words(in, blocka + i);
+		MD5Transform(iva, in);
+		load_words(in, blockb + i);
+		MD5Transform(ivb, in);
+	}
+	return memcmp(iva, ivb, sizeof(iva)) == 0;
+}
+
 #ifdef BENCHMARK
 #define NUM_RUNS 100
 int main(void) {
@@ -0,0 +1,169 @@
+/* Hashing straight out of files, for the --prefix option.
+ *
+ * The prefix can be arbitrarily large (several GiB is not unusual), so it
+ * is mapped a window at a time and every whole block is handed directly to
+ * MD5Transform rather than being copied through MD5Update's buffer. The
+ * midstate after the last whole block is remembered in the on-disk cache,
+ * keyed by the file's identity, the length hashed and the starting IV, so
+ * later jobs against the same prefix only need to read the final partial
+ * block.
+ *
+ * MD5HashFiles digests whole files for checking a finished set of outputs,
+ * a lane-width of files at a time through the multi-buffer engine and over
+ * a few threads.
+ */
+#define _FILE_OFFSET_BITS 64
+#include "md5.h"
+#include "cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// must be a multiple of the page size
+#define MAP_WINDOW (64UL << 20)
+
+struct prefix_key {
+	uint64_t dev, ino, size;
+	uint64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+	uint64_t len;
+	uint32_t iv[4];
+};
+
+static int hash_whole_blocks(int fd, uint32_t state[4], uint64_t whole) {
+	for(uint64_t off = 0; off < whole; off += MAP_WINDOW) {
+		size_t n = whole - off < MAP_WINDOW ? whole - off : MAP_WINDOW;
+		unsigned char *p = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, off);
+		if(p == MAP_FAILED)
+			return -1;
+		madvise(p, n, MADV_SEQUENTIAL);
+		MD5TransformBlocks(state, p, n / 64);
+		munmap(p, n);
+	}
+	return 0;
+}
+
+int MD5PrefixContext(struct MD5Context *ctx, const char *path, uint64_t len, int flags) {
+	uint64_t whole = len & ~(uint64_t)63;
+	struct prefix_key key;
+	struct stat st;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if(fstat(fd, &st) < 0 || (uint64_t)st.st_size < len)
+		goto fail;
+
+	memset(&key, 0, sizeof(key));
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+	key.size = st.st_size;
+	key.mtime_sec = st.st_mtim.tv_sec;
+	key.mtime_nsec = st.st_mtim.tv_nsec;
+	key.ctime_sec = st.st_ctim.tv_sec;
+	key.ctime_nsec = st.st_ctim.tv_nsec;
+	key.len = whole;
+	memcpy(key.iv, ctx->buf, sizeof(key.iv));
+
+	if(whole > 0 && !((flags & MD5_PREFIX_CACHE) &&
+	                  CollCacheLoad("prefix", &key, sizeof(key), ctx->buf, sizeof(ctx->buf)))) {
+		if(hash_whole_blocks(fd, ctx->buf, whole) < 0)
+			goto fail;
+		if(flags & MD5_PREFIX_CACHE)
+			CollCacheStore("prefix", &key, sizeof(key), ctx->buf, sizeof(ctx->buf));
+	}
+
+	for(uint64_t off = whole; off < len; ) {
+		ssize_t r = pread(fd, ctx->in + (off - whole), len - off, off);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			goto fail;
+		off += r;
+	}
+
+	ctx->bits[0] = (uint32_t)(len << 3);
+	ctx->bits[1] = (uint32_t)(len >> 29);
+	close(fd);
+	return 0;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+struct hash_files {
+	const char *const *paths;
+	unsigned char *digests;
+	int n, next, group, failed;
+};
+
+static void *hash_files_thread(void *arg) {
+	struct hash_files *hf = arg;
+	const unsigned char *bufs[16];
+	size_t lens[16];
+	int first;
+
+	while((first = __atomic_fetch_add(&hf->next, hf->group, __ATOMIC_RELAXED)) < hf->n) {
+		int count = hf->n - first < hf->group ? hf->n - first : hf->group;
+		int mapped = 0, ok = 1;
+
+		for(; mapped < count; mapped++) {
+			struct stat st;
+			int fd = open(hf->paths[first + mapped], O_RDONLY);
+			if(fd < 0 || fstat(fd, &st) < 0) {
+				if(fd >= 0)
+					close(fd);
+				ok = 0;
+				break;
+			}
+			lens[mapped] = st.st_size;
+			bufs[mapped] = NULL;
+			if(st.st_size > 0) {
+				void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if(p == MAP_FAILED) {
+					close(fd);
+					ok = 0;
+					break;
+				}
+				madvise(p, st.st_size, MADV_SEQUENTIAL);
+				bufs[mapped] = p;
+			}
+			close(fd);
+		}
+		if(ok) {
+			MD5MultiBuffer(bufs, lens, count, hf->digests + 16*first);
+		} else {
+			__atomic_store_n(&hf->failed, 1, __ATOMIC_RELAXED);
+			memset(hf->digests + 16*first, 0, 16*count);
+		}
+		for(int i = 0; i < mapped; i++)
+			if(lens[i] > 0)
+				munmap((void *)bufs[i], lens[i]);
+	}
+	return NULL;
+}
+
+int MD5HashFiles(const char *const *paths, int n, unsigned char *digests, int nthreads) {
+	struct hash_files hf = { paths, digests, n, 0, MD5MultiBufferLanes(), 0 };
+	pthread_t threads[64];
+	int started = 0;
+
+	if(nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads > (n + hf.group - 1) / hf.group)
+		nthreads = (n + hf.group - 1) / hf.group;
+	if(nthreads > 64)
+		nthreads = 64;
+	// the calling thread is one of the workers
+	for(int i = 1; i < nthreads; i++)
+		if(pthread_create(&threads[started], NULL, hash_files_thread, &hf) == 0)
+			started++;
+	hash_files_thread(&hf);
+	for(int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	return hf.failed ? -1 : 0;
+}
@@ -0,0 +1,262 @@
+/* Multi-buffer MD5.
+ *
+ * The outputs of a run are N files of the same length that differ in a
+ * handful of 128-byte blocks, so rather than hashing them one after the
+ * other we hash them side by side, one stream per SIMD lane. The round
+ * function is written once with GCC vector extensions and instantiated at
+ * 4, 8 and 16 lanes; on x86 the wider ones are also built for AVX2 and
+ * AVX-512 and picked at runtime. The scalar MD5Transform in md5.c is still
+ * what everything else uses.
+ *
+ * MD5MultiBuffer keeps every lane busy: each lane works through its own
+ * stream (data then padding) and as soon as one finishes its digest is
+ * written out and the next pending stream is loaded into that lane.
+ */
+#include "md5.h"
+#include <string.h>
+
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef uint32_t v8u __attribute__((vector_size(32)));
+typedef uint32_t v16u __attribute__((vector_size(64)));
+
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+#define MD5STEP(f, w, x, y, z, data, s) \
+	( w += f(x, y, z) + data,  w = w<<s | w>>(32-s),  w += x )
+
+static inline uint32_t load32le(const unsigned char *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+/* state is word-major, state[w*W + lane]; blocks[lane] points at 64 bytes */
+#define MD5MB_KERNEL(name, W, V, ATTR) \
+ATTR static void name(uint32_t *state, const unsigned char *const *blocks) { \
+	V a, b, c, d, in[16]; \
+	for(int i = 0; i < 16; i++) \
+		for(int l = 0; l < W; l++) \
+			in[i][l] = load32le(blocks[l] + 4*i); \
+	memcpy(&a, state, sizeof(V)); \
+	memcpy(&b, state + W, sizeof(V)); \
+	memcpy(&c, state + 2*W, sizeof(V)); \
+	memcpy(&d, state + 3*W, sizeof(V)); \
+	V a0 = a, b0 = b, c0 = c, d0 = d; \
+	MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7); \
+	MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12); \
+	MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17); \
+	MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22); \
+	MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7); \
+	MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12); \
+	MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17); \
+	MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22); \
+	MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7); \
+	MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12); \
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17); \
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22); \
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7); \
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12); \
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17); \
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22); \
+	MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5); \
+	MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9); \
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14); \
+	MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20); \
+	MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5); \
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9); \
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14); \
+	MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20); \
+	MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5); \
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9); \
+	MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14); \
+	MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20); \
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5); \
+	MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9); \
+	MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14); \
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20); \
+	MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4); \
+	MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11); \
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16); \
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23); \
+	MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4); \
+	MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11); \
+	MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16); \
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23); \
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4); \
+	MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11); \
+	MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16); \
+	MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23); \
+	MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4); \
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11); \
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16); \
+	MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23); \
+	MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6); \
+	MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10); \
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15); \
+	MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21); \
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6); \
+	MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10); \
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15); \
+	MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21); \
+	MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6); \
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10); \
+	MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15); \
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21); \
+	MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6); \
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10); \
+	MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15); \
+	MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21); \
+	a += a0; b += b0; c += c0; d += d0; \
+	memcpy(state, &a, sizeof(V)); \
+	memcpy(state + W, &b, sizeof(V)); \
+	memcpy(state + 2*W, &c, sizeof(V)); \
+	memcpy(state + 3*W, &d, sizeof(V)); \
+}
+
+MD5MB_KERNEL(transform_x4, 4, v4u, )
+MD5MB_KERNEL(transform_x8, 8, v8u, )
+MD5MB_KERNEL(transform_x16, 16, v16u, )
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MD5MB_X86
+MD5MB_KERNEL(transform_x8_avx2, 8, v8u, __attribute__((target("avx2"))))
+MD5MB_KERNEL(transform_x16_avx512, 16, v16u, __attribute__((target("avx512f"))))
+#endif
+
+int MD5MultiBufferLanes(void) {
+	static int lanes;
+
+	if(lanes == 0) {
+		int l = 4;
+#ifdef MD5MB_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f"))
+			l = 16;
+		else if(__builtin_cpu_supports("avx2"))
+			l = 8;
+#endif
+		lanes = l;
+	}
+	return lanes;
+}
+
+void MD5TransformMB(int lanes, uint32_t *state, const unsigned char *const *blocks) {
+	switch(lanes) {
+	case 4:
+		transform_x4(state, blocks);
+		break;
+	case 8:
+#ifdef MD5MB_X86
+		if(MD5MultiBufferLanes() >= 8) {
+			transform_x8_avx2(state, blocks);
+			break;
+		}
+#endif
+		transform_x8(state, blocks);
+		break;
+	case 16:
+#ifdef MD5MB_X86
+		if(MD5MultiBufferLanes() >= 16) {
+			transform_x16_avx512(state, blocks);
+			break;
+		}
+#endif
+		transform_x16(state, blocks);
+		break;
+	default:
+		// one block per stream, the slow way
+		for(int l = 0; l < lanes; l++) {
+			uint32_t st[4], in[16];
+			for(int w = 0; w < 4; w++)
+				st[w] = state[w*lanes + l];
+			for(int i = 0; i < 16; i++)
+				in[i] = load32le(blocks[l] + 4*i);
+			MD5Transform(st, in);
+			for(int w = 0; w < 4; w++)
+				state[w*lanes + l] = st[w];
+		}
+	}
+}
+
+#define MD5MB_MAX_LANES 16
+
+struct lane {
+	int stream;                 // -1 when idle
+	const unsigned char *data;
+	size_t whole, block, nblocks;
+	unsigned char tail[128];    // last partial block plus padding
+};
+
+static void lane_load(struct lane *ln, const unsigned char *buf, size_t len, int stream) {
+	size_t rem = len % 64, padlen = rem < 56 ? 64 : 128;
+	uint64_t bits = (uint64_t)len << 3;
+
+	ln->stream = stream;
+	ln->data = buf;
+	ln->whole = len / 64;
+	ln->block = 0;
+	ln->nblocks = ln->whole + padlen / 64;
+	memset(ln->tail, 0, sizeof(ln->tail));
+	if(rem)
+		memcpy(ln->tail, buf + len - rem, rem);
+	ln->tail[rem] = 0x80;
+	for(int i = 0; i < 8; i++)
+		ln->tail[padlen - 8 + i] = bits >> (8*i);
+}
+
+static const unsigned char *lane_block(const struct lane *ln) {
+	if(ln->block < ln->whole)
+		return ln->data + 64*ln->block;
+	return ln->tail + 64*(ln->block - ln->whole);
+}
+
+void MD5MultiBuffer(const unsigned char *const *bufs, const size_t *lens, int n, unsigned char *digests) {
+	static const uint32_t iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	static const unsigned char idle[64];
+	struct lane lanes[MD5MB_MAX_LANES];
+	uint32_t state[4*MD5MB_MAX_LANES];
+	const unsigned char *blocks[MD5MB_MAX_LANES];
+	int W = MD5MultiBufferLanes(), next = 0, active = 0;
+
+	while(W > 4 && W/2 >= n)
+		W /= 2;
+	for(int l = 0; l < W; l++) {
+		lanes[l].stream = -1;
+		if(next < n) {
+			lane_load(&lanes[l], bufs[next], lens[next], next);
+			next++;
+			active++;
+		}
+		for(int w = 0; w < 4; w++)
+			state[w*W + l] = iv[w];
+	}
+
+	while(active > 0) {
+		for(int l = 0; l < W; l++)
+			blocks[l] = lanes[l].stream < 0 ? idle : lane_block(&lanes[l]);
+		MD5TransformMB(W, state, blocks);
+
+		for(int l = 0; l < W; l++) {
+			struct lane *ln = &lanes[l];
+			if(ln->stream < 0 || ++ln->block < ln->nblocks)
+				continue;
+			unsigned char *digest = digests + 16*ln->stream;
+			for(int w = 0; w < 4; w++) {
+				uint32_t v = state[w*W + l];
+				digest[4*w] = v;
+				digest[4*w+1] = v >> 8;
+				digest[4*w+2] = v >> 16;
+				digest[4*w+3] = v >> 24;
+				state[w*W + l] = iv[w];
+			}
+			ln->stream = -1;
+			active--;
+			if(next < n) {
+				lane_load(ln, bufs[next], lens[next], next);
+				next++;
+				active++;
+			}
+		}
+	}
+}
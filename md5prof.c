@@ -0,0 +1,174 @@
+/* Per-thread, per-stage hardware counters for the collision searches.
+ *
+ * A thread gets its profile the first time it switches stage: a perf
+ * event group on itself, user space only, plus a record on the list the
+ * report walks. The counts at each switch are charged to the stage being
+ * left. Records outlive their threads (search.c starts fresh threads for
+ * every collision) but the events are closed when the thread exits.
+ */
+#define _GNU_SOURCE
+#include "md5prof.h"
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NEVENTS 4
+
+static const struct {
+	const char *name;
+	uint64_t config;
+} events[NEVENTS] = {
+	{ "cycles", PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+	{ "branch-misses", PERF_COUNT_HW_BRANCH_MISSES },
+	{ "cache-misses", PERF_COUNT_HW_CACHE_MISSES },
+};
+
+static const char *const stage_names[PROF_STAGES] = { NULL, "stage1", "tunnels", "inner" };
+
+struct counts {
+	uint64_t ns;		/* thread CPU time */
+	uint64_t v[NEVENTS];
+};
+
+struct thread_profile {
+	pid_t tid;
+	int fd;			/* group leader, -1 if no event would open */
+	int fds[NEVENTS];	/* each event's own, -1 if it didn't open */
+	int slot[NEVENTS];	/* where each event is in a group read */
+	int nopen;
+	int block, stage;	/* being counted now */
+	struct counts last;	/* at the last switch */
+	struct counts stages[2][PROF_STAGES];
+	uint64_t candidates[2];
+	struct thread_profile *next;
+};
+
+__thread int md5prof_stage;
+static __thread struct thread_profile *self;
+static struct thread_profile *threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+
+static void read_counts(struct thread_profile *p, struct counts *c) {
+	struct timespec ts;
+	uint64_t buf[1 + NEVENTS];
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	c->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if(p->fd < 0 || read(p->fd, buf, sizeof(buf)) < (ssize_t)(sizeof(uint64_t) * (1 + p->nopen)))
+		return;
+	for(int e = 0; e < NEVENTS; e++) {
+		if(p->fds[e] >= 0)
+			c->v[e] = buf[1 + p->slot[e]];
+	}
+}
+
+static void thread_exit(void *arg) {
+	struct thread_profile *p = arg;
+	// the record stays for the report
+	for(int e = 0; e < NEVENTS; e++) {
+		if(p->fds[e] >= 0)
+			close(p->fds[e]);
+	}
+	p->fd = -1;
+}
+
+static void report_at_exit(void) {
+	MD5ProfileReport(stderr);
+}
+
+static void init_once(void) {
+	pthread_key_create(&exit_key, thread_exit);
+	atexit(report_at_exit);
+}
+
+static struct thread_profile *open_profile(void) {
+	struct thread_profile *p = calloc(1, sizeof(*p));
+	if(!p)
+		return NULL;
+	pthread_once(&once, init_once);
+	p->tid = syscall(SYS_gettid);
+	p->fd = -1;
+	for(int e = 0; e < NEVENTS; e++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = events[e].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		p->fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, p->fd, 0);
+		if(p->fds[e] < 0)
+			continue;
+		p->slot[e] = p->nopen++;
+		if(p->fd < 0)
+			p->fd = p->fds[e];
+	}
+	pthread_setspecific(exit_key, p);
+
+	pthread_mutex_lock(&threads_lock);
+	p->next = threads;
+	threads = p;
+	pthread_mutex_unlock(&threads_lock);
+	return p;
+}
+
+void MD5ProfileSwitch(int block, int stage) {
+	struct thread_profile *p = self;
+	struct counts now = { 0 };
+
+	if(!p && (p = self = open_profile()) == NULL)
+		return;
+	read_counts(p, &now);
+	if(p->stage != PROF_NONE) {
+		struct counts *c = &p->stages[p->block][p->stage];
+		c->ns += now.ns - p->last.ns;
+		for(int e = 0; e < NEVENTS; e++)
+			c->v[e] += now.v[e] - p->last.v[e];
+	}
+	p->last = now;
+	p->block = block;
+	p->stage = stage;
+	md5prof_stage = PROF_ID(block, stage);
+}
+
+void MD5ProfileCandidates(int block, uint64_t n) {
+	if(self)
+		self->candidates[block] += n;
+}
+
+void MD5ProfileReport(FILE *f) {
+	pthread_mutex_lock(&threads_lock);
+	for(struct thread_profile *p = threads; p; p = p->next) {
+		for(int b = 0; b < 2; b++) {
+			uint64_t ns = 0;
+			for(int s = PROF_STAGE1; s < PROF_STAGES; s++)
+				ns += p->stages[b][s].ns;
+			if(ns == 0)
+				continue;
+			fprintf(f, "md5prof: thread %d block %d: %llu candidates in %.3fs, %.0f/s\n", (int)p->tid, b,
+			        (unsigned long long)p->candidates[b], ns / 1e9, p->candidates[b] / (ns / 1e9));
+			for(int s = PROF_STAGE1; s < PROF_STAGES; s++) {
+				const struct counts *c = &p->stages[b][s];
+				fprintf(f, "md5prof:   %-8s %8.3fs", stage_names[s], c->ns / 1e9);
+				for(int e = 0; e < NEVENTS; e++) {
+					if(p->fds[e] < 0)
+						fprintf(f, "  %s n/a", events[e].name);
+					else
+						fprintf(f, "  %s %llu", events[e].name, (unsigned long long)c->v[e]);
+				}
+				if(p->fds[0] >= 0 && p->fds[1] >= 0 && c->v[0])
+					fprintf(f, "  IPC %.2f", (double)c->v[1] / c->v[0]);
+				fputc('\n', f);
+			}
+		}
+	}
+	pthread_mutex_unlock(&threads_lock);
+}
@@ -0,0 +1,48 @@
+#ifndef MD5PROF_H
+#define MD5PROF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Where the collision searches spend their time (md5prof.c), built in with
+ * make PROFILING=1 and a no-op otherwise. Each search thread opens its own
+ * perf_event_open group (cycles, instructions, branch misses, cache
+ * misses) and reads it whenever the search moves between stages, so each
+ * count lands on the block and stage it belongs to:
+ *
+ *   stage 1   the random Q[1..16] and the Q[17..21] search
+ *   tunnels   the Q[10] and Q[4] tunnels around the inner loop
+ *   inner     the Q[9] tunnel, where the candidates are tried
+ *
+ * Every read is a syscall, so a block 1 inner pass (512 candidates) comes
+ * out a little heavier than it really is. Counters the kernel won't give
+ * us (no PMU in a VM, say) show as n/a; CPU time is always there. The
+ * totals for every thread that searched go to stderr at exit. */
+
+enum {
+	PROF_NONE,
+	PROF_STAGE1,
+	PROF_TUNNELS,
+	PROF_INNER,
+	PROF_STAGES
+};
+
+#ifdef PROFILING
+extern __thread int md5prof_stage;
+extern void MD5ProfileSwitch(int block, int stage);
+extern void MD5ProfileCandidates(int block, uint64_t n);
+/* Every thread's counts so far, per block and stage */
+extern void MD5ProfileReport(FILE *f);
+
+#define PROF_ID(block, stage) ((stage) == PROF_NONE ? 0 : (block) * PROF_STAGES + (stage))
+#define PROF_STAGE(block, stage) do { \
+		if(md5prof_stage != PROF_ID(block, stage)) \
+			MD5ProfileSwitch(block, stage); \
+	} while(0)
+#define PROF_CANDIDATES(block, n) MD5ProfileCandidates(block, n)
+#else
+#define PROF_STAGE(block, stage) do { } while(0)
+#define PROF_CANDIDATES(block, n) do { } while(0)
+#endif
+
+#endif /* !MD5PROF_H */
@@ -0,0 +1,46 @@
+/* md5verify: hash a set of files in one pass with the multi-buffer engine
+ * and check that they all share a digest, e.g. every output of a run or of
+ * a whole batch of runs.
+ *
+ *   md5verify [-q] file1 file2 ..
+ *
+ * Prints md5sum-style lines unless -q is given. Exits 0 if all the digests
+ * match, 1 if they don't and 2 if a file couldn't be read.
+ */
+#include "md5.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+	int quiet = 0, n, mismatch = 0;
+	unsigned char *digests;
+
+	if(argc > 1 && strcmp(argv[1], "-q") == 0) {
+		quiet = 1;
+		argv++;
+		argc--;
+	}
+	if(argc < 2) {
+		fprintf(stderr, "Usage: md5verify [-q] file1 file2 ..\n");
+		return 2;
+	}
+	n = argc - 1;
+	if((digests = malloc(16*n)) == NULL)
+		return 2;
+	if(MD5HashFiles((const char *const *)argv + 1, n, digests, 0) < 0) {
+		fprintf(stderr, "md5verify: could not read all files\n");
+		return 2;
+	}
+	for(int i = 0; i < n; i++) {
+		if(memcmp(digests, digests + 16*i, 16) != 0)
+			mismatch = 1;
+		if(quiet)
+			continue;
+		for(int j = 0; j < 16; j++)
+			printf("%02x", digests[16*i + j]);
+		printf("  %s\n", argv[i + 1]);
+	}
+	free(digests);
+	return mismatch;
+}
@@ -0,0 +1,137 @@
+/* Writing the variant outputs, see output.h */
+#define _GNU_SOURCE
+#include "output.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+// the source ended before len; errno from an earlier call would mislead
+static int short_source(void) {
+	errno = EIO;
+	return -1;
+}
+
+static int copy_rw(int in, int out, off_t len) {
+	char buf[1 << 16];
+	off_t off = 0;
+
+	while(off < len) {
+		ssize_t r = pread(in, buf, sizeof(buf), off);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r == 0)
+			return short_source();
+		if(r < 0)
+			return -1;
+		for(ssize_t done = 0; done < r; ) {
+			ssize_t w = pwrite(out, buf + done, r - done, off + done);
+			if(w < 0 && errno == EINTR)
+				continue;
+			if(w <= 0)
+				return -1;
+			done += w;
+		}
+		off += r;
+	}
+	return 0;
+}
+
+// errors meaning "this method isn't available here" rather than real I/O errors
+static int unsupported(int err) {
+	return err == ENOSYS || err == EOPNOTSUPP || err == ENOTTY || err == EXDEV ||
+	       err == EINVAL || err == EBADF || err == EPERM;
+}
+
+static int copy_fd(int in, int out, off_t len) {
+#ifdef __linux__
+	off_t done = 0;
+
+	if(ioctl(out, FICLONE, in) == 0)
+		return 0;
+
+	// copy_file_range can manage part of the file before giving up on
+	// it (EXDEV on older kernels) so carry on from wherever it got to
+	while(done < len) {
+		off_t inoff = done, outoff = done;
+		ssize_t r = copy_file_range(in, &inoff, out, &outoff, len - done, 0);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r == 0)
+			return short_source();
+		if(r < 0)
+			break;
+		done += r;
+	}
+	if(done == len)
+		return 0;
+	if(!unsupported(errno))
+		return -1;
+
+	if(lseek(out, done, SEEK_SET) == done) {
+		while(done < len) {
+			off_t inoff = done;
+			ssize_t r = sendfile(out, in, &inoff, len - done);
+			if(r < 0 && errno == EINTR)
+				continue;
+			if(r == 0)
+				return short_source();
+			if(r < 0)
+				break;
+			done += r;
+		}
+		if(done == len)
+			return 0;
+		if(!unsupported(errno))
+			return -1;
+	}
+#endif
+	return copy_rw(in, out, len);
+}
+
+int CollCloneFile(const char *src, const char *dst) {
+	struct stat st;
+	int in, out, r, err;
+
+	if((in = open(src, O_RDONLY)) < 0)
+		return -1;
+	if(fstat(in, &st) < 0 || (out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		err = errno;
+		close(in);
+		errno = err;
+		return -1;
+	}
+	r = copy_fd(in, out, st.st_size);
+	err = errno;
+	close(in);
+	if(close(out) < 0 && r == 0) {
+		err = errno;
+		r = -1;
+	}
+	errno = err;
+	return r;
+}
+
+int CollWriteVariant(const char *base, const char *path, const struct CollPatch *patches, int npatches) {
+	int fd, err;
+
+	if(CollCloneFile(base, path) < 0)
+		return -1;
+	if((fd = open(path, O_WRONLY)) < 0)
+		return -1;
+	for(int i = 0; i < npatches; i++) {
+		if(pwrite(fd, patches[i].block, sizeof(patches[i].block), patches[i].position) != sizeof(patches[i].block)) {
+			err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+	}
+	return close(fd);
+}
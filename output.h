@@ -0,0 +1,22 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+
+/* Every output of a run is the same file apart from a few 128-byte
+ * collision blocks. The base output is written once; each variant is then
+ * a copy-on-write clone of it (FICLONE), or failing that an in-kernel copy
+ * (copy_file_range, then sendfile), with only its substituted blocks
+ * rewritten in place. */
+
+struct CollPatch {
+	uint64_t position;
+	unsigned char block[128];
+};
+
+/* Make dst a copy of src. Returns 0 on success, -1 with errno set. */
+extern int CollCloneFile(const char *src, const char *dst);
+/* Copy base to path and apply the patches. Returns 0 on success. */
+extern int CollWriteVariant(const char *base, const char *path, const struct CollPatch *patches, int npatches);
+
+#endif /* !OUTPUT_H */
@@ -0,0 +1,451 @@
+/* A pool of collision search threads shared between jobs.
+ *
+ * Like MD5FindCollision, every worker on a job runs the whole block 0 then
+ * block 1 search with its own seed, and the first one to finish wins. Since
+ * a restart loses nothing, workers can be moved between jobs freely: the
+ * scheduler just sets a worker's stop flag and it comes back for another
+ * job the next time the search checks it.
+ */
+#include "md5.h"
+#include "pool.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_POOL_THREADS 256
+
+struct worker {
+	struct CollPool *pool;
+	struct CollJob *job;
+	struct CollJob *next;	/* where it's been sent when preempted */
+	volatile int stop;
+	int counted;	/* still counted in job->workers */
+	pthread_t thread;
+};
+
+/* A job and the variants submitted alongside it. Workers are shared out
+ * between groups, so racing variants of one search takes no more of the
+ * pool than the search would on its own. */
+struct group {
+	int workers;	/* the sum of its jobs' */
+	int refs;	/* jobs not yet freed */
+};
+
+struct CollJob {
+	struct CollPool *pool;
+	struct group *group;
+	struct CollJob *next;	/* in pool->jobs while queued or running */
+	uint32_t iv[4];
+	char badchars[256];
+	int has_badchars;
+	int priority;
+	int flags;
+	uint64_t seed;
+	uint64_t starts;
+	int state;
+	int workers;	/* workers on it or on their way to it */
+	int busy;	/* workers holding a pointer to it */
+	int released;
+	int fd;		/* eventfd, signalled when it's over */
+	uint64_t block0s;
+	struct timespec submitted;
+	uint32_t blocks[32];
+};
+
+struct CollPool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct CollJob *jobs;
+	int njobs;	/* not yet freed, queued or not */
+	int shutdown;	/* destroyed; freed along with the last job */
+	int nthreads;
+	struct worker workers[MAX_POOL_THREADS];
+};
+
+static uint64_t ms_since(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void unlink_job(struct CollPool *pool, struct CollJob *job) {
+	for(struct CollJob **p = &pool->jobs; *p; p = &(*p)->next) {
+		if(*p == job) {
+			*p = job->next;
+			break;
+		}
+	}
+}
+
+static void signal_job(struct CollJob *job) {
+	uint64_t one = 1;
+	while(write(job->fd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+}
+
+// job is over: stop everyone on it and wake whoever is waiting
+static void finish_job(struct CollPool *pool, struct CollJob *job, int state) {
+	job->state = state;
+	unlink_job(pool, job);
+	signal_job(job);
+	for(int i = 0; i < pool->nthreads; i++) {
+		struct worker *w = &pool->workers[i];
+		if(w->job == job)
+			w->stop = 1;
+	}
+	pthread_cond_broadcast(&pool->done);
+	// the freed workers are looking for something else to do
+	pthread_cond_broadcast(&pool->work);
+}
+
+static void maybe_free_job(struct CollJob *job) {
+	if(job->released && job->busy == 0) {
+		job->pool->njobs--;
+		if(--job->group->refs == 0)
+			free(job->group);
+		close(job->fd);
+		free(job);
+	}
+}
+
+static void free_pool(struct CollPool *pool) {
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static void count_workers(struct CollJob *job, int n) {
+	job->workers += n;
+	job->group->workers += n;
+}
+
+// highest priority first, then the group with the fewest workers, then the
+// job in it with the fewest, then the oldest
+static int needier(const struct CollJob *a, const struct CollJob *b) {
+	if(a->priority != b->priority)
+		return a->priority > b->priority;
+	if(a->group->workers != b->group->workers)
+		return a->group->workers < b->group->workers;
+	return a->workers < b->workers;
+}
+
+static struct CollJob *pick_job(struct CollPool *pool) {
+	struct CollJob *best = NULL;
+	for(struct CollJob *job = pool->jobs; job; job = job->next) {
+		if(!best || needier(job, best))
+			best = job;
+	}
+	return best;
+}
+
+static int is_live(const struct CollJob *job) {
+	return job->state == COLL_JOB_QUEUED || job->state == COLL_JOB_RUNNING;
+}
+
+/* Send a worker over to target from a job of lower priority, or from one of
+ * the same priority whose group has at least two more workers (or, in
+ * target's own group, that has at least two more itself). The move is counted
+ * straight away so the next call sees the new balance. Returns 1 if a
+ * worker was told to stop. */
+static int preempt_for(struct CollPool *pool, struct CollJob *target) {
+	struct worker *victim = NULL;
+	for(int i = 0; i < pool->nthreads; i++) {
+		struct worker *w = &pool->workers[i];
+		struct CollJob *job = w->job;
+		if(!job || !w->counted || job == target || !is_live(job))
+			continue;
+		if(job->priority > target->priority)
+			continue;
+		if(job->priority == target->priority && (job->group == target->group ?
+		   job->workers < target->workers + 2 : job->group->workers < target->group->workers + 2))
+			continue;
+		if(!victim || needier(victim->job, job))
+			victim = w;
+	}
+	if(!victim)
+		return 0;
+	victim->counted = 0;
+	count_workers(victim->job, -1);
+	victim->next = target;
+	count_workers(target, 1);
+	target->busy++;
+	victim->stop = 1;
+	return 1;
+}
+
+// only needed when nobody is idle; idle workers pick the neediest job anyway
+static void rebalance(struct CollPool *pool) {
+	for(int i = 0; i < pool->nthreads; i++) {
+		struct worker *w = &pool->workers[i];
+		if(!w->job || (!is_live(w->job) && !w->next))
+			return;
+	}
+	for(;;) {
+		struct CollJob *neediest = pick_job(pool);
+		if(!neediest || !preempt_for(pool, neediest))
+			return;
+	}
+}
+
+static void *worker_thread(void *arg) {
+	struct worker *w = arg;
+	struct CollPool *pool = w->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	for(;;) {
+		struct CollJob *job = w->next;
+		w->next = NULL;
+		if(job && !is_live(job)) {
+			// finished while we were on our way
+			count_workers(job, -1);
+			job->busy--;
+			maybe_free_job(job);
+			job = NULL;
+		}
+		if(!job) {
+			while(!pool->shutdown && !(job = pick_job(pool)))
+				pthread_cond_wait(&pool->work, &pool->lock);
+			if(pool->shutdown)
+				break;
+			count_workers(job, 1);
+			job->busy++;
+		}
+
+		job->state = COLL_JOB_RUNNING;
+		w->job = job;
+		w->counted = 1;
+		w->stop = 0;
+		uint64_t seed = job->seed + 0x9e3779b97f4a7c15ULL * (2*++job->starts + 1);
+		const char *badchars = job->has_badchars ? job->badchars : NULL;
+		uint32_t iv[4], blocks[32];
+		memcpy(iv, job->iv, sizeof(iv));
+		pthread_mutex_unlock(&pool->lock);
+
+		int found = MD5CollideBlock0Ex(iv, blocks, badchars, seed, &w->stop);
+		if(found) {
+			__atomic_add_fetch(&job->block0s, 1, __ATOMIC_RELAXED);
+			MD5Transform(iv, blocks);
+			found = MD5CollideBlock1Ex(iv, blocks + 16, badchars, seed ^ 0xdeadf00d, &w->stop);
+		}
+		// outside the lock; if two workers finish together both store a good collision
+		if(found && (job->flags & MD5_COLLISION_CACHE))
+			MD5CollisionCacheStore(job->iv, badchars, blocks);
+
+		pthread_mutex_lock(&pool->lock);
+		if(w->counted)
+			count_workers(job, -1);
+		job->busy--;
+		w->job = NULL;
+		w->counted = 0;
+		if(found && job->state == COLL_JOB_RUNNING) {
+			memcpy(job->blocks, blocks, sizeof(blocks));
+			finish_job(pool, job, COLL_JOB_DONE);
+		}
+		maybe_free_job(job);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct CollPool *CollPoolCreate(int nthreads) {
+	struct CollPool *pool = calloc(1, sizeof(*pool));
+	if(!pool)
+		return NULL;
+	if(nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads > MAX_POOL_THREADS)
+		nthreads = MAX_POOL_THREADS;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	for(int i = 0; i < nthreads; i++) {
+		struct worker *w = &pool->workers[pool->nthreads];
+		w->pool = pool;
+		if(pthread_create(&w->thread, NULL, worker_thread, w) == 0)
+			pool->nthreads++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if(pool->nthreads == 0) {
+		CollPoolDestroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void CollPoolDestroy(struct CollPool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while(pool->jobs)
+		finish_job(pool, pool->jobs, COLL_JOB_CANCELLED);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for(int i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	// handles still out keep the pool's lock alive until they're released
+	pthread_mutex_lock(&pool->lock);
+	int last = pool->njobs == 0;
+	pthread_mutex_unlock(&pool->lock);
+	if(last)
+		free_pool(pool);
+}
+
+int CollPoolThreads(struct CollPool *pool) {
+	return pool->nthreads;
+}
+
+// with the lock held
+static void join_group(struct CollPool *pool, struct CollJob *job, struct group *group) {
+	pool->njobs++;
+	if(group)
+		job->group = group;
+	job->group->refs++;
+}
+
+// group is the sibling's, or NULL to start a new one
+static struct CollJob *submit(struct CollPool *pool, struct group *group, const uint32_t iv[4],
+                              const char *badchars, int priority, int flags) {
+	struct CollJob *job = calloc(1, sizeof(*job));
+	if(!job)
+		return NULL;
+	if(!group && (job->group = calloc(1, sizeof(*job->group))) == NULL) {
+		free(job);
+		return NULL;
+	}
+	if((job->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+		if(!group)
+			free(job->group);
+		free(job);
+		return NULL;
+	}
+	job->pool = pool;
+	memcpy(job->iv, iv, sizeof(job->iv));
+	if(badchars) {
+		memcpy(job->badchars, badchars, sizeof(job->badchars));
+		job->has_badchars = 1;
+	}
+	job->priority = priority;
+	job->flags = flags;
+	job->seed = MD5SearchSeed() ^ (uint64_t)(uintptr_t)job;
+	job->state = COLL_JOB_QUEUED;
+	clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+
+	if((flags & MD5_COLLISION_CACHE) && MD5CollisionCacheLoad(iv, badchars, job->blocks)) {
+		job->state = COLL_JOB_DONE;
+		signal_job(job);
+		pthread_mutex_lock(&pool->lock);
+		join_group(pool, job, group);
+		pthread_mutex_unlock(&pool->lock);
+		return job;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	join_group(pool, job, group);
+	// append, so equal jobs are started oldest first
+	struct CollJob **p = &pool->jobs;
+	while(*p)
+		p = &(*p)->next;
+	*p = job;
+	rebalance(pool);
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	return job;
+}
+
+struct CollJob *CollPoolSubmit(struct CollPool *pool, const uint32_t iv[4], const char *badchars, int priority, int flags) {
+	return submit(pool, NULL, iv, badchars, priority, flags);
+}
+
+struct CollJob *CollPoolSubmitVariant(struct CollJob *sibling, const uint32_t iv[4], int flags) {
+	return submit(sibling->pool, sibling->group, iv, sibling->has_badchars ? sibling->badchars : NULL,
+	              sibling->priority, flags);
+}
+
+int CollJobWait(struct CollJob *job, int timeout_ms) {
+	struct CollPool *pool = job->pool;
+	struct timespec deadline;
+	int state;
+
+	if(timeout_ms >= 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if(deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+	pthread_mutex_lock(&pool->lock);
+	while(job->state == COLL_JOB_QUEUED || job->state == COLL_JOB_RUNNING) {
+		if(timeout_ms < 0)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		else if(pthread_cond_timedwait(&pool->done, &pool->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+	state = job->state;
+	pthread_mutex_unlock(&pool->lock);
+	return state;
+}
+
+int CollJobPoll(struct CollJob *job) {
+	struct CollPool *pool = job->pool;
+	pthread_mutex_lock(&pool->lock);
+	int state = job->state;
+	pthread_mutex_unlock(&pool->lock);
+	return state;
+}
+
+int CollJobFd(struct CollJob *job) {
+	return job->fd;
+}
+
+void CollJobGetStatus(struct CollJob *job, struct CollJobStatus *status) {
+	struct CollPool *pool = job->pool;
+	pthread_mutex_lock(&pool->lock);
+	status->state = job->state;
+	status->workers = job->workers;
+	status->block0s = __atomic_load_n(&job->block0s, __ATOMIC_RELAXED);
+	status->elapsed_ms = ms_since(&job->submitted);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int CollJobResult(struct CollJob *job, uint32_t blocks[32]) {
+	struct CollPool *pool = job->pool;
+	int rc = -1;
+	pthread_mutex_lock(&pool->lock);
+	if(job->state == COLL_JOB_DONE) {
+		memcpy(blocks, job->blocks, sizeof(job->blocks));
+		rc = 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return rc;
+}
+
+void CollJobCancel(struct CollJob *job) {
+	struct CollPool *pool = job->pool;
+	pthread_mutex_lock(&pool->lock);
+	if(job->state == COLL_JOB_QUEUED || job->state == COLL_JOB_RUNNING)
+		finish_job(pool, job, COLL_JOB_CANCELLED);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void CollJobRelease(struct CollJob *job) {
+	struct CollPool *pool = job->pool;
+	pthread_mutex_lock(&pool->lock);
+	if(job->state == COLL_JOB_QUEUED || job->state == COLL_JOB_RUNNING)
+		finish_job(pool, job, COLL_JOB_CANCELLED);
+	job->released = 1;
+	maybe_free_job(job);
+	int last = pool->shutdown && pool->njobs == 0;
+	pthread_mutex_unlock(&pool->lock);
+	if(last)
+		free_pool(pool);
+}
@@ -0,0 +1,70 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+/* A long-lived pool of collision search threads shared by any number of
+ * jobs (pool.c). Each job is one two-block collision for an IV; idle
+ * workers take the highest-priority job with the fewest workers on it and
+ * race it with a fresh seed, and a newly submitted job takes workers off
+ * jobs of lower priority, or off jobs that have more than their share, as
+ * soon as they next check their stop flag. A job's variants (see
+ * CollPoolSubmitVariant) count as part of it when the shares are worked out.
+ *
+ * Nothing here blocks except CollJobWait: a caller can submit, then watch
+ * CollJobFd from its own event loop and collect the result when it fires. */
+
+struct CollPool;
+struct CollJob;
+
+enum {
+	COLL_JOB_QUEUED,	/* no worker has picked it up yet */
+	COLL_JOB_RUNNING,
+	COLL_JOB_DONE,
+	COLL_JOB_CANCELLED,
+};
+
+struct CollJobStatus {
+	int state;
+	int workers;		/* threads on it right now */
+	uint64_t block0s;	/* first blocks found so far, over all workers */
+	uint64_t elapsed_ms;	/* since it was submitted */
+};
+
+/* nthreads = 0 starts one worker per CPU. NULL on failure. */
+extern struct CollPool *CollPoolCreate(int nthreads);
+/* Cancels whatever is left and joins the workers. Jobs not yet released
+ * still have to be (nothing else may be done with them but the job calls
+ * below); the pool's memory goes with the last of them. */
+extern void CollPoolDestroy(struct CollPool *pool);
+extern int CollPoolThreads(struct CollPool *pool);
+
+/* Queue a search for iv. badchars is a 256-entry table as for
+ * MD5CollideBlock0, or NULL, and is copied. Higher priorities run first.
+ * flags is MD5_COLLISION_CACHE or 0, as for MD5FindCollision; a cache hit
+ * comes back already done. */
+extern struct CollJob *CollPoolSubmit(struct CollPool *pool, const uint32_t iv[4], const char *badchars, int priority, int flags);
+/* Queue another search for the same thing as sibling, from a different IV,
+ * at sibling's priority and with its badchars: a hedge against sibling
+ * being slow. The two share one job's worth of workers, so racing several
+ * variants takes no more of a busy pool than the one search would. */
+extern struct CollJob *CollPoolSubmitVariant(struct CollJob *sibling, const uint32_t iv[4], int flags);
+/* Wait up to timeout_ms (-1 = forever) for the job to finish and return
+ * its state. */
+extern int CollJobWait(struct CollJob *job, int timeout_ms);
+/* The state right now, without waiting */
+extern int CollJobPoll(struct CollJob *job);
+/* An eventfd that becomes readable once the job is done or cancelled. It
+ * belongs to the job and is closed by CollJobRelease; don't read it if
+ * anyone else might be waiting on it. */
+extern int CollJobFd(struct CollJob *job);
+extern void CollJobGetStatus(struct CollJob *job, struct CollJobStatus *status);
+/* Block 0 then block 1 of the first message once COLL_JOB_DONE, 0 on
+ * success. */
+extern int CollJobResult(struct CollJob *job, uint32_t blocks[32]);
+/* Stop searching; a job that has already finished is left alone. */
+extern void CollJobCancel(struct CollJob *job);
+/* Give up the handle, cancelling the job if it's still going. */
+extern void CollJobRelease(struct CollJob *job);
+
+#endif /* !POOL_H */
@@ -0,0 +1,152 @@
+/* Racing a collision search over several threads.
+ *
+ * The block searches are randomised restarts, so running T copies with
+ * different seeds and keeping whichever finishes first cuts the expected
+ * time to a collision by roughly T. Each thread does block 0 and then
+ * block 1 on its own; the first to have both wins and tells the others
+ * to stop.
+ */
+#include "md5.h"
+#include "cache.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SEARCH_THREADS 256
+
+struct race {
+	const uint32_t *iv;
+	const char *badchars;
+	uint64_t seed;
+	volatile int stop;
+	int found;
+	uint32_t blocks[32];
+	pthread_mutex_t lock;
+};
+
+struct racer {
+	struct race *race;
+	int index;
+};
+
+/* Everything a collision depends on besides the seed: the IV, the bytes the
+ * blocks were allowed to contain and the bytes md5coll.c forces into them,
+ * which is fixed by how it's compiled (the same flags as this file). */
+struct collision_key {
+	char magic[8];
+	uint32_t iv[4];
+	uint32_t hacks;
+	char badchars[256];
+};
+
+static void collision_key(struct collision_key *key, const uint32_t iv[4], const char *badchars) {
+	memset(key, 0, sizeof(*key));
+	memcpy(key->magic, "fastcol1", 8);
+	memcpy(key->iv, iv, sizeof(key->iv));
+#ifdef JPEGHACK
+	key->hacks |= 1;
+#endif
+#ifdef PDFHACK
+	key->hacks |= 2;
+#endif
+	if(badchars)
+		memcpy(key->badchars, badchars, sizeof(key->badchars));
+}
+
+void MD5CollisionMessages(const uint32_t blocks[32], unsigned char a[128], unsigned char b[128]) {
+	static const uint32_t delta[16] = { [4] = 1U << 31, [11] = 1 << 15, [14] = 1U << 31 };
+	for(int i = 0; i < 32; i++) {
+		uint32_t wb = i < 16 ? blocks[i] + delta[i] : blocks[i] - delta[i - 16];
+		for(int j = 0; j < 4; j++) {
+			a[4*i + j] = blocks[i] >> 8*j;
+			b[4*i + j] = wb >> 8*j;
+		}
+	}
+}
+
+int MD5CollisionCacheLoad(const uint32_t iv[4], const char *badchars, uint32_t blocks[32]) {
+	struct collision_key key;
+	unsigned char a[128], b[128];
+
+	collision_key(&key, iv, badchars);
+	if(!CollCacheLoad("collisions", &key, sizeof(key), a, sizeof(a)))
+		return 0;
+	for(int i = 0; i < 32; i++)
+		blocks[i] = a[4*i] | a[4*i+1] << 8 | a[4*i+2] << 16 | (uint32_t)a[4*i+3] << 24;
+	// don't trust the disk: a bad entry is just a miss
+	MD5CollisionMessages(blocks, a, b);
+	return MD5VerifyCollision(iv, a, b);
+}
+
+void MD5CollisionCacheStore(const uint32_t iv[4], const char *badchars, const uint32_t blocks[32]) {
+	struct collision_key key;
+	unsigned char a[128], b[128];
+
+	collision_key(&key, iv, badchars);
+	MD5CollisionMessages(blocks, a, b);
+	CollCacheStore("collisions", &key, sizeof(key), a, sizeof(a));
+}
+
+uint64_t MD5SearchSeed(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000007ULL ^ (uint64_t)ts.tv_nsec ^ (uint64_t)getpid() << 40;
+}
+
+static void *race_thread(void *arg) {
+	struct racer *r = arg;
+	struct race *race = r->race;
+	uint64_t seed = race->seed + 0x9e3779b97f4a7c15ULL * (2*r->index + 1);
+	uint32_t iv[4], blocks[32];
+
+	memcpy(iv, race->iv, sizeof(iv));
+	if(!MD5CollideBlock0Ex(iv, blocks, race->badchars, seed, &race->stop))
+		return NULL;
+	MD5Transform(iv, blocks);
+	if(!MD5CollideBlock1Ex(iv, blocks + 16, race->badchars, seed ^ 0xdeadf00d, &race->stop))
+		return NULL;
+
+	pthread_mutex_lock(&race->lock);
+	if(!race->found) {
+		race->found = 1;
+		memcpy(race->blocks, blocks, sizeof(blocks));
+		race->stop = 1;
+	}
+	pthread_mutex_unlock(&race->lock);
+	return NULL;
+}
+
+int MD5FindCollision(const uint32_t iv[4], uint32_t blocks[32], const char *badchars, int nthreads, int flags) {
+	struct race race = { iv, badchars, MD5SearchSeed(), 0, 0 };
+	struct racer racers[MAX_SEARCH_THREADS];
+	pthread_t threads[MAX_SEARCH_THREADS];
+	int started = 0;
+
+	if((flags & MD5_COLLISION_CACHE) && MD5CollisionCacheLoad(iv, badchars, blocks))
+		return 0;
+	if(nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads > MAX_SEARCH_THREADS)
+		nthreads = MAX_SEARCH_THREADS;
+	pthread_mutex_init(&race.lock, NULL);
+	for(int i = 1; i < nthreads; i++) {
+		racers[started].race = &race;
+		racers[started].index = i;
+		if(pthread_create(&threads[started], NULL, race_thread, &racers[started]) == 0)
+			started++;
+	}
+	// the calling thread races too
+	struct racer self = { &race, 0 };
+	race_thread(&self);
+	for(int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&race.lock);
+
+	if(!race.found)
+		return -1;
+	memcpy(blocks, race.blocks, sizeof(race.blocks));
+	if(flags & MD5_COLLISION_CACHE)
+		MD5CollisionCacheStore(iv, badchars, blocks);
+	return 0;
+}